@@ -0,0 +1,133 @@
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <streambuf>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+// `DescriptorBuf` is a write-only `std::streambuf` that writes to a file
+// descriptor through a large buffer. Writes at least as large as the buffer
+// are handed to the operating system directly, together with whatever is
+// buffered, in a single `writev` call, so that large blocks of output are not
+// copied.
+class DescriptorBuf : public std::streambuf {
+  int fd;
+  std::vector<char> buffer;
+  // `broken` indicates that a write to `fd` failed. Once set, all output is
+  // discarded and reported as failed.
+  bool broken;
+  // `written` is the number of bytes written to `fd` so far.
+  std::uint64_t written;
+
+  // Write the specified `count` buffers described by the specified `chunks`
+  // to `fd` in their entirety. Return whether successful.
+  bool write_all(iovec *chunks, int count);
+
+  // Write the buffered output to `fd`. Return whether successful.
+  bool drain();
+
+protected:
+  int_type overflow(int_type ch) override;
+  std::streamsize xsputn(const char *data, std::streamsize count) override;
+  int sync() override;
+
+public:
+  // `buffer_size` is the number of bytes buffered before they are written to
+  // the file descriptor.
+  static constexpr std::size_t buffer_size = 1 << 20;
+
+  explicit DescriptorBuf(int fd);
+  DescriptorBuf(const DescriptorBuf&) = delete;
+  DescriptorBuf& operator=(const DescriptorBuf&) = delete;
+
+  // Write any buffered output, but don't close the file descriptor.
+  ~DescriptorBuf();
+
+  // Return the number of bytes written to the file descriptor so far, which
+  // excludes any that are still buffered.
+  std::uint64_t bytes_written() const { return written; }
+};
+
+inline
+DescriptorBuf::DescriptorBuf(int fd)
+: fd(fd)
+, buffer(buffer_size)
+, broken(false)
+, written(0) {
+  setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+inline
+DescriptorBuf::~DescriptorBuf() {
+  drain();
+}
+
+inline
+bool DescriptorBuf::write_all(iovec *chunks, int count) {
+  while (count != 0 && !broken) {
+    const ssize_t rc = ::writev(fd, chunks, count);
+    if (rc < 0) {
+      if (errno != EINTR) {
+        broken = true;
+      }
+      continue;
+    }
+    written += rc;
+    // Skip past what was written, which might end within a chunk.
+    std::size_t skipped = rc;
+    while (count != 0 && skipped >= chunks->iov_len) {
+      skipped -= chunks->iov_len;
+      ++chunks;
+      --count;
+    }
+    if (count != 0) {
+      chunks->iov_base = static_cast<char*>(chunks->iov_base) + skipped;
+      chunks->iov_len -= skipped;
+    }
+  }
+  return !broken;
+}
+
+inline
+bool DescriptorBuf::drain() {
+  iovec chunk{.iov_base = pbase(), .iov_len = std::size_t(pptr() - pbase())};
+  setp(buffer.data(), buffer.data() + buffer.size());
+  return write_all(&chunk, chunk.iov_len != 0);
+}
+
+inline
+DescriptorBuf::int_type DescriptorBuf::overflow(int_type ch) {
+  if (!drain()) {
+    return traits_type::eof();
+  }
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+  }
+  return traits_type::not_eof(ch);
+}
+
+inline
+std::streamsize DescriptorBuf::xsputn(const char *data, std::streamsize count) {
+  if (count < epptr() - pptr()) {
+    traits_type::copy(pptr(), data, count);
+    pbump(count);
+    return count;
+  }
+  if (std::size_t(count) < buffer.size()) {
+    return std::streambuf::xsputn(data, count);
+  }
+
+  iovec chunks[] = {
+    {.iov_base = pbase(), .iov_len = std::size_t(pptr() - pbase())},
+    {.iov_base = const_cast<char*>(data), .iov_len = std::size_t(count)}};
+  setp(buffer.data(), buffer.data() + buffer.size());
+  return write_all(chunks, 2) ? count : 0;
+}
+
+inline
+int DescriptorBuf::sync() {
+  return drain() ? 0 : -1;
+}
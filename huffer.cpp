@@ -1,252 +1,45 @@
-#include "input_bit_stream.h"
-#include "output_bit_stream.h"
+#include "descriptor_buf.h"
+#include "huffer.h"
+#include "mapped_file.h"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
 #include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
-#include <fstream>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <istream>
-#include <locale>
+#include <limits>
 #include <memory>
-#include <queue>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stop_token>
+#include <streambuf>
 #include <string>
 #include <string_view>
 #include <system_error>
-#include <unordered_map>
+#include <thread>
+#include <utility>
 #include <vector>
 
-// `symbol_size` is the size, in bytes, of each input symbol.
-// It is at least one byte and at most eight bytes.
-// When encoding, the value is set based on a command line option.
-// When decoding, the value is read from the file header.
-// `symbol_size` is used in the implementation of `class Symbol`.
-std::size_t symbol_size = 1;
-
-// `Symbol` is a fixed size chunk of the uncompressed input.
-// Huffman coding works by choosing shorter code words for more frequent
-// symbols, and longer code words for less frequent symbols.
-class Symbol {
-  std::array<char, 8> storage;
-public:
-  const char *data() const { return storage.data(); }
-  char *data() { return storage.data(); }
-  const char *begin() const { return data(); }
-  char *begin() { return data(); }
-  const char *end() const { return data() + symbol_size; }
-  char *end() { return data() + symbol_size; }
-  std::size_t size() const { return symbol_size; }
-  char& operator[](std::size_t i) { return storage[i]; }
-  char operator[](std::size_t i) const { return storage[i]; }
-};
-
-bool operator==(const Symbol& left, const Symbol& right) {
-  return std::equal(left.begin(), left.end(), right.begin());
-}
-
-std::ostream& operator<<(std::ostream& stream, const Symbol& symbol) {
-  return stream.write(symbol.data(), symbol.size());
-}
-
-struct HashSymbol {
-  std::size_t operator()(Symbol symbol) const {
-    return hash_bytes(symbol.data(), symbol.size());
-  }
-
-  static long hash_bytes(const char* begin, std::size_t size) {
-    return std::use_facet<std::collate<char>>(std::locale::classic()).hash(begin, begin + size);
-  }
-};
-
-struct SymbolInfo {
-  // `frequency` is how often the symbol appears in the decoded file.
-  // It's used during encoding and graphing.
-  std::uint64_t frequency = 0;
-  // `code_word` are the bits of the encoded version of the symbol.
-  // It's used during encoding.
-  std::vector<bool> code_word;
-};
-
-struct Symbols {
-  // `info` maps each input symbol to information needed for encoding or
-  // graphing.
-  std::unordered_map<Symbol, SymbolInfo, HashSymbol> info;
-  // `extra` is any trailing (unencoded) data. If the unencoded file's size is
-  // not a multiple of the symbol size, then `extra` will contain the
-  // remainder.
-  // It's used during graphing.
-  std::string extra;
-  // `total_size` is the length, in bytes, of the entire input.
-  std::uint64_t total_size = 0;
-};
-
-struct Node {
-  // `weight` is the sum of all symbol frequencies in the subtree rooted at
-  // this node.
-  // It's used during encoding and graphing.
-  std::uint64_t weight;
-  // `type`, `leaf`, and `internal` form a discriminated union.
-  // A `Node` is either a leaf node or an internal node.
-  // A leaf node is just a `Symbol`.
-  // An internal node contains pointers to its left and right subtrees.
-  // The `left` subtree corresponds to a 0 bit in the code word, while
-  // the `right` subtree corresponds to a 1 bit in the code word.
-  // The subtrees of an internal node are never null.
-  // An internal node also contains an integer ID, which is used during
-  // graphing.
-  enum class Type : bool {
-    leaf,
-    internal
-  } type;
-  union {
-    Symbol leaf;
-    struct {
-      std::uint64_t id;
-      Node *left;
-      Node *right;
-    } internal;
-  };
-};
-
-// `Tree` is a deleting wrapper around a (root) `Node`.
-// Destroying a `Node` does not destroy its children, but destroying a `Tree`
-// destroys all descendant `Node`s.
-struct NodeDeleter {
-  void operator()(Node *root) const {
-    if (!root) {
-      return;
-    }
-    std::vector<Node*> stack;
-    stack.push_back(root);
-    do {
-      Node *node = stack.back();
-      stack.pop_back();
-      if (node->type == Node::Type::internal) {
-        stack.push_back(node->internal.left);
-        stack.push_back(node->internal.right);
-      }
-      delete node;
-    } while (!stack.empty());
-  }
-};
-
-using Tree = std::unique_ptr<Node, NodeDeleter>;
-
-Symbols read_symbols(std::istream& in) {
-  Symbols symbols;
-
-  Symbol buffer;
-  for (;;) {
-    in.read(buffer.data(), buffer.size());
-    const int count = in.gcount();
-    symbols.total_size += count;
-    if (count < int(symbol_size)) {
-      symbols.extra.assign(buffer.data(), count);
-      break;
-    }
-    ++symbols.info[buffer].frequency;
-  }
-
-  return symbols;
-}
-
-// We want our heap (`priority_queue`) to be a min-heap on `Node::weight`.
-// Since `priority_queue` is a max-heap, this comparator is reversed.
-struct ByWeightReversed {
-  bool operator()(const Node *left, const Node *right) const {
-    return left->weight > right->weight;
-  }
-};
-
-Tree build_tree(const Symbols& symbols) {
-  std::priority_queue<Node*, std::vector<Node*>, ByWeightReversed> heap;
-
-  // First the leaves.
-  for (const auto& [symbol, info] : symbols.info) {
-    heap.push(new Node{
-      .weight = info.frequency,
-      .type = Node::Type::leaf,
-      .leaf = symbol
-    });
-  }
-
-  // Build up the tree's internal nodes greedily, always taking the two lowest
-  // weighted nodes to create a new node.
-  std::uint64_t next_node_id = 1;
-  while (heap.size() > 1) {
-    Node *left = heap.top();
-    heap.pop();
-    Node *right = heap.top();
-    heap.pop();
-    heap.push(new Node{
-      .weight = left->weight + right->weight,
-      .type = Node::Type::internal,
-      .internal = {
-        .id = next_node_id++,
-        .left = left,
-        .right = right
-      }
-    });
-  }
-
-  if (heap.empty()) {
-    return nullptr;
-  }
-  return Tree(heap.top());
-}
-
-void build_code_words(Symbols& symbols, const Node *root) {
-  if (!root) {
-    return;
-  }
-  // Corner case: If there's only one symbol, then it codes to "0".
-  if (root->type == Node::Type::leaf) {
-    std::vector<bool> zero;
-    zero.push_back(false);
-    symbols.info.find(root->leaf)->second.code_word = zero;
-    return;
-  }
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
-  struct Ancestor {
-    const Node *node;
-    std::vector<bool> prefix;
-  };
-  std::vector<Ancestor> ancestors;
-  ancestors.push_back({.node = root, .prefix = std::vector<bool>{}});
-  do {
-    auto [parent, prefix] = std::move(ancestors.back());
-    ancestors.pop_back();
-
-    const Node *left = parent->internal.left;
-    const Node *right = parent->internal.right;
-    std::vector<bool> left_prefix = prefix;
-    left_prefix.push_back(false);
-    std::vector<bool> right_prefix = std::move(prefix);
-    right_prefix.push_back(true);
-
-    if (left->type == Node::Type::leaf) {
-      symbols.info[left->leaf].code_word = std::move(left_prefix);
-    } else {
-      ancestors.push_back({
-        .node = left,
-        .prefix = std::move(left_prefix)
-      });
-    }
-
-    if (right->type == Node::Type::leaf) {
-      symbols.info[right->leaf].code_word = std::move(right_prefix);
-    } else {
-      ancestors.push_back({
-        .node = right,
-        .prefix = std::move(right_prefix)
-      });
-    }
-  } while (!ancestors.empty());
-}
+using namespace huffer;
 
 void putc_dubscaped(std::ostream& out, char c) {
   switch (c) {
@@ -302,11 +95,13 @@ HexedPrinter<Chars> hexed(const Chars& chars) {
 
 struct LabelQuotedPrinter {
   const Node& node;
+  std::size_t symbol_size;
 
   friend std::ostream& operator<<(std::ostream& out, LabelQuotedPrinter printer) {
     const Node& node = printer.node;
     if (node.type == Node::Type::leaf) {
-      out << "\"\\\"" << dubscaped(node.leaf) << "\\\" (" << std::dec << node.weight << ")\"";
+      const std::string_view symbol(node.leaf.data(), printer.symbol_size);
+      out << "\"\\\"" << dubscaped(symbol) << "\\\" (" << std::dec << node.weight << ")\"";
     } else {
       out << "\"(" << std::dec << node.weight << ")\"";
     }
@@ -314,17 +109,19 @@ struct LabelQuotedPrinter {
   }
 };
 
-LabelQuotedPrinter label_quoted(const Node& node) {
-  return LabelQuotedPrinter{.node = node};
+LabelQuotedPrinter label_quoted(const Node& node, std::size_t symbol_size) {
+  return LabelQuotedPrinter{.node = node, .symbol_size = symbol_size};
 }
 
 struct NamePrinter {
   const Node& node;
+  std::size_t symbol_size;
 
   friend std::ostream& operator<<(std::ostream& out, NamePrinter printer) {
     const Node& node = printer.node;
     if (node.type == Node::Type::leaf) {
-      out << "leaf_0x" << hexed(node.leaf);
+      const std::string_view symbol(node.leaf.data(), printer.symbol_size);
+      out << "leaf_0x" << hexed(symbol);
     } else {
       out << "internal_" << std::dec << static_cast<std::uint64_t>(node.internal.id);
     }
@@ -332,12 +129,14 @@ struct NamePrinter {
   }
 };
 
-NamePrinter name(const Node& node) {
-  return NamePrinter{.node = node};
+NamePrinter name(const Node& node, std::size_t symbol_size) {
+  return NamePrinter{.node = node, .symbol_size = symbol_size};
 }
 
-void graph_tree(std::ostream& out, const Node& root, const std::string& extra) {
+void graph_tree(std::ostream& out, const Tree& tree, const std::string& extra, std::size_t symbol_size) {
   const char *indent = "  ";
+  const auto name = [=](const Node& node) { return ::name(node, symbol_size); };
+  const auto label_quoted = [=](const Node& node) { return ::label_quoted(node, symbol_size); };
   out << "digraph {\n";
 
   if (!extra.empty()) {
@@ -346,7 +145,7 @@ void graph_tree(std::ostream& out, const Node& root, const std::string& extra) {
   }
 
   std::vector<const Node*> stack;
-  stack.push_back(&root);
+  stack.push_back(&tree.root());
   do {
     const Node& node = *stack.back();
     stack.pop_back();
@@ -354,221 +153,1176 @@ void graph_tree(std::ostream& out, const Node& root, const std::string& extra) {
     if (node.type == Node::Type::leaf) {
       continue;
     }
-    out << indent << name(node) << " -> " << name(*node.internal.left) << " [label=\"0\"];\n";
-    out << indent << name(node) << " -> " << name(*node.internal.right) << " [label=\"1\"];\n";
-    stack.push_back(node.internal.left);
-    stack.push_back(node.internal.right);
+    out << indent << name(node) << " -> " << name(tree.left(node)) << " [label=\"0\"];\n";
+    out << indent << name(node) << " -> " << name(tree.right(node)) << " [label=\"1\"];\n";
+    stack.push_back(&tree.left(node));
+    stack.push_back(&tree.right(node));
   } while (!stack.empty());
 
   out << "}\n";
 }
 
-OutputBitStream& operator<<(OutputBitStream& out, const Symbol& symbol) {
-  for (char byte : symbol) {
-    out << byte;
-  }
-  return out;
-}
 
-void write_tree(OutputBitStream& out, const Node *root) {
-  if (root == nullptr) {
-    return;
+// `RangeBuf` is a write-only `std::streambuf` that passes along to another
+// `std::streambuf` only those bytes written within a range of positions, and
+// discards the rest.
+class RangeBuf : public std::streambuf {
+  std::streambuf& sink;
+  // `skip` is the number of bytes yet to be discarded before the range, and
+  // `remaining` is the number of bytes yet to be passed along.
+  std::uint64_t skip;
+  std::uint64_t remaining;
+
+protected:
+  int_type overflow(int_type ch) override {
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+      return traits_type::not_eof(ch);
+    }
+    const char byte = traits_type::to_char_type(ch);
+    return xsputn(&byte, 1) == 1 ? ch : traits_type::eof();
   }
 
-  // The format for a node is <type><payload>.
-  // <type> is a single bit: 0 means "internal" and 1 means "leaf."
-  // <payload> for a leaf is the symbol.
-  // <payload> for a node is the left child followed by the right child.
-  std::vector<const Node*> stack;
-  stack.push_back(root);
-  do {
-    const Node *node = stack.back();
-    stack.pop_back();
-    if (node->type == Node::Type::leaf) {
-      out << true;
-      out << node->leaf;
-      continue;
+  std::streamsize xsputn(const char *data, std::streamsize count) override {
+    const std::uint64_t skipped = std::min<std::uint64_t>(skip, count);
+    skip -= skipped;
+    const std::uint64_t length = std::min<std::uint64_t>(remaining, count - skipped);
+    remaining -= length;
+    if (length != 0 && sink.sputn(data + skipped, length) != std::streamsize(length)) {
+      return 0;
     }
-    out << false;
-    stack.push_back(node->internal.right);
-    stack.push_back(node->internal.left);
-  } while (!stack.empty());
-}
+    return count;
+  }
+
+  int sync() override {
+    return sink.pubsync();
+  }
 
-InputBitStream& operator>>(InputBitStream& in, Symbol& symbol) {
-  for (char& byte : symbol) {
-    in >> byte;
+public:
+  // Pass along to the specified `sink` the specified `length` bytes starting
+  // at the specified `offset`.
+  RangeBuf(std::streambuf& sink, std::uint64_t offset, std::uint64_t length)
+  : sink(sink)
+  , skip(offset)
+  , remaining(length) {
+  }
+};
+
+
+// Discard the specified `count` bytes from the specified `in`, seeking past
+// them if `in` supports it. Return `in`.
+std::istream& skip(std::istream& in, std::uint64_t count) {
+  if (in.rdbuf()->pubseekoff(count, std::ios_base::cur, std::ios_base::in) == std::streampos(-1) &&
+      std::uint64_t(in.ignore(count).gcount()) != count) {
+    in.setstate(std::ios_base::failbit);
   }
   return in;
 }
 
-Tree read_tree(InputBitStream& in) {
-  // If an error occurs, return `nullptr`.
 
-  // The format for a node is <type><payload>.
-  // <type> is a single bit: 0 means "internal" and 1 means "leaf."
-  // <payload> for a leaf is the symbol.
-  // <payload> for a node is the left child followed by the right child.
-  bool is_leaf;
-  in >> is_leaf;
-  if (!in) {
-    return nullptr;
-  }
-#pragma GCC diagnostic push
-  // You're wrong, GCC. You're WRONG.
-#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
-  if (is_leaf) {
-#pragma GCC diagnostic pop
-    // The root is a leaf.
-    Symbol symbol;
-    in >> symbol;
-    if (!in) {
-      return nullptr;
-    }
-    return Tree(new Node{
-      .weight = 0, // unused
-      .type = Node::Type::leaf,
-      .leaf = symbol
-    });
-  }
-
-  // The root is an internal node.
-  Tree root;
-  std::uint64_t next_node_id = 1;
-  root.reset(new Node{
-    .weight = 0,
-    .type = Node::Type::internal,
-    .internal = {
-      .id = next_node_id++,
-      .left = nullptr, // TBD
-      .right = nullptr // TBD
+// `default_block_size` is the decoded size of blocks when encoding from
+// standard input, unless otherwise specified.
+constexpr std::uint64_t default_block_size = 4 << 20;
+
+// `StatsFormat` is how `--stats` reports measurements (see `Stats`), if at
+// all.
+enum class StatsFormat {
+  none,
+  text,
+  json
+};
+
+// `Options` are the command line options that affect encoding, decoding, and
+// graphing. When using blocks, `threads` is instead the number of blocks that
+// may be encoded or decoded concurrently.
+struct Options : EncodeOptions {
+  // `block_size` is the decoded size of each block, or zero if the input is
+  // to be encoded as one piece (which requires two passes over the input).
+  std::uint64_t block_size = 0;
+  // `streams` is the number of streams into which the encoder divides the
+  // code words of each block (see `BlockKind::huffman_streams`).
+  unsigned streams = 1;
+  // `index` is whether the encoder follows the blocks with an index (see
+  // `BlockKind`).
+  bool index = false;
+  // `range_offset` and `range_length` are the position and size of the part
+  // of the decoded output that the decoder writes.
+  std::uint64_t range_offset = 0;
+  std::uint64_t range_length = std::numeric_limits<std::uint64_t>::max();
+  // `table` is the path to a code table file (see `CodeTable`) with which to
+  // encode or decode, or null if there is none.
+  const char *table = nullptr;
+  // `stats` is the format in which to print measurements of encoding or
+  // decoding to standard error.
+  StatsFormat stats = StatsFormat::none;
+  // `auto_symbol_size` is whether the encoder chooses the symbol size from
+  // the input (see `choose_symbol_size`) instead of using `symbol_size`.
+  bool auto_symbol_size = false;
+  // `context` is the number of symbols before each symbol that the encoder
+  // may code it in the context of (see `BlockKind::huffman_context`), which
+  // is zero or one.
+  unsigned context = 0;
+  // `batch` is whether the input names many files to encode (see
+  // `main_encode_batch`), in which case `threads` is instead the number of
+  // files that may be encoded concurrently.
+  bool batch = false;
+};
+
+// `max_threads` is the largest allowed value of `Options::threads`.
+constexpr unsigned max_threads = 1024;
+
+// Return the policy with which to launch the encoding or decoding of a block,
+// and assign to the specified `in_flight` the number of blocks that may be
+// in progress while the next block is read. With only one thread, blocks are
+// processed one at a time by the main thread.
+std::launch block_policy(const Options& options, std::size_t& in_flight) {
+  if (options.threads > 1) {
+    in_flight = options.threads;
+    return std::launch::async;
+  }
+  in_flight = 0;
+  return std::launch::deferred;
+}
+
+// `Stopwatch` measures wall time in laps.
+class Stopwatch {
+  std::chrono::steady_clock::time_point start;
+
+public:
+  Stopwatch()
+  : start(std::chrono::steady_clock::now()) {
+  }
+
+  // Return the number of seconds since the creation of this object or the
+  // previous call to `lap`, whichever was later.
+  double lap() {
+    const auto now = std::chrono::steady_clock::now();
+    const std::chrono::duration<double> elapsed = now - start;
+    start = now;
+    return elapsed.count();
+  }
+};
+
+// `Stage` is the wall time spent in a stage of encoding or decoding, and the
+// number of bytes of decoded data for which the stage ran.
+struct Stage {
+  double seconds = 0;
+  std::uint64_t bytes = 0;
+
+  void add(double more_seconds, std::uint64_t more_bytes) {
+    seconds += more_seconds;
+    bytes += more_bytes;
+  }
+};
+
+// `Stats` are the measurements of encoding or decoding that `--stats`
+// reports. With blocks, the stages of each block are measured separately and
+// added up, so if blocks are processed concurrently, then the stages can add
+// up to more than the total time.
+struct Stats {
+  Stage read_symbols;
+  Stage build_code_lengths;
+  Stage build_code_words;
+  Stage write_code_lengths;
+  Stage encode;
+  Stage read_code;
+  Stage decode;
+  // `input_bytes` is the size of the input, or zero if it is not known.
+  std::uint64_t input_bytes = 0;
+  std::uint64_t output_bytes = 0;
+  std::uint64_t blocks = 0;
+  // `stored_blocks` is the number of blocks stored rather than coded (see
+  // `BlockKind::stored`), and `reused_blocks` is the number of blocks that
+  // reuse the code of a block before them (see `BlockKind::huffman_reuse`).
+  // `context_blocks` is the number of blocks coded in an order-1 model (see
+  // `BlockKind::huffman_context`).
+  std::uint64_t stored_blocks = 0;
+  std::uint64_t reused_blocks = 0;
+  std::uint64_t context_blocks = 0;
+  // `symbols` is the number of symbols encoded or decoded, excluding any
+  // "extra."
+  std::uint64_t symbols = 0;
+  // `distinct_symbols` is the number of distinct symbols in the input, or,
+  // with blocks, the most in any one block. `code_bits` is the total length
+  // of the code words of the symbols, and `entropy_bits` is the total of their
+  // information content, each according to the symbol frequencies of the
+  // input (or of its block). These are measured only when encoding with a
+  // code of the input's own.
+  std::uint64_t distinct_symbols = 0;
+  std::uint64_t code_bits = 0;
+  double entropy_bits = 0;
+
+  Stats& operator+=(const Stats& other);
+};
+
+Stats& Stats::operator+=(const Stats& other) {
+  read_symbols.add(other.read_symbols.seconds, other.read_symbols.bytes);
+  build_code_lengths.add(other.build_code_lengths.seconds, other.build_code_lengths.bytes);
+  build_code_words.add(other.build_code_words.seconds, other.build_code_words.bytes);
+  write_code_lengths.add(other.write_code_lengths.seconds, other.write_code_lengths.bytes);
+  encode.add(other.encode.seconds, other.encode.bytes);
+  read_code.add(other.read_code.seconds, other.read_code.bytes);
+  decode.add(other.decode.seconds, other.decode.bytes);
+  input_bytes += other.input_bytes;
+  output_bytes += other.output_bytes;
+  blocks += other.blocks;
+  stored_blocks += other.stored_blocks;
+  reused_blocks += other.reused_blocks;
+  context_blocks += other.context_blocks;
+  symbols += other.symbols;
+  distinct_symbols = std::max(distinct_symbols, other.distinct_symbols);
+  code_bits += other.code_bits;
+  entropy_bits += other.entropy_bits;
+  return *this;
+}
+
+// Add to the specified `stats` the count and the entropy of the specified
+// `symbols`, and the specified `code_bits`, the total length of their code
+// words.
+void measure_code(const Symbols& symbols, std::uint64_t code_bits, Stats& stats) {
+  std::uint64_t count = 0;
+  for (const SymbolTable::Entry& entry : symbols.info) {
+    count += entry.info.frequency;
+  }
+  for (const SymbolTable::Entry& entry : symbols.info) {
+    const std::uint64_t frequency = entry.info.frequency;
+    stats.entropy_bits += frequency * std::log2(double(count) / frequency);
+  }
+  stats.code_bits += code_bits;
+  stats.symbols += count;
+  stats.distinct_symbols = std::max<std::uint64_t>(stats.distinct_symbols, symbols.info.size());
+}
+
+// Print to the specified `out` in the specified `format` the specified
+// `stats` of the specified `command`, which took the specified `seconds`,
+// and the peak memory usage of this process. If `encoding`, then the output
+// is the compressed data. Otherwise, the input is.
+void print_stats(std::ostream& out, StatsFormat format, const std::string& command, bool encoding, double seconds, const Stats& stats) {
+  const std::pair<const char*, const Stage*> stages[] = {
+    {"read_symbols", &stats.read_symbols},
+    {"build_code_lengths", &stats.build_code_lengths},
+    {"build_code_words", &stats.build_code_words},
+    {"write_code_lengths", &stats.write_code_lengths},
+    {"encode", &stats.encode},
+    {"read_code", &stats.read_code},
+    {"decode", &stats.decode}};
+  const auto ran = [](const Stage& stage) { return stage.seconds != 0 || stage.bytes != 0; };
+  rusage usage = {};
+  ::getrusage(RUSAGE_SELF, &usage);
+  const std::uint64_t peak_memory = std::uint64_t(usage.ru_maxrss) * 1024;
+  const std::uint64_t compressed_bytes = encoding ? stats.output_bytes : stats.input_bytes;
+  const bool measured = stats.distinct_symbols != 0 && stats.symbols != 0;
+  const bool achieved = compressed_bytes != 0 && stats.symbols != 0;
+
+  if (format == StatsFormat::json) {
+    out << "{\"command\": \"" << command << "\", \"seconds\": " << seconds << ", \"stages\": {";
+    const char *separator = "";
+    for (const auto& [name, stage] : stages) {
+      if (ran(*stage)) {
+        out << separator << '"' << name << "\": {\"seconds\": " << stage->seconds
+            << ", \"bytes\": " << stage->bytes << '}';
+        separator = ", ";
+      }
     }
-  });
-  std::vector<Node*> ancestors;
-  ancestors.push_back(root.get());
-  do {
-    Node *parent = ancestors.back();
-    assert(parent->type == Node::Type::internal);
-    if (parent->internal.left && parent->internal.right) {
-      ancestors.pop_back();
-      continue;
+    out << "}, \"input_bytes\": " << stats.input_bytes << ", \"output_bytes\": " << stats.output_bytes
+        << ", \"blocks\": " << stats.blocks << ", \"stored_blocks\": " << stats.stored_blocks
+        << ", \"reused_blocks\": " << stats.reused_blocks << ", \"context_blocks\": " << stats.context_blocks
+        << ", \"symbols\": " << stats.symbols;
+    if (measured) {
+      out << ", \"distinct_symbols\": " << stats.distinct_symbols
+          << ", \"average_code_length\": " << double(stats.code_bits) / stats.symbols
+          << ", \"entropy_bits_per_symbol\": " << stats.entropy_bits / stats.symbols;
     }
+    if (achieved) {
+      out << ", \"bits_per_symbol\": " << compressed_bytes * 8.0 / stats.symbols;
+    }
+    out << ", \"peak_memory_bytes\": " << peak_memory << "}\n";
+    return;
+  }
 
-    bool is_leaf;
-    in >> is_leaf;
-    if (!in) {
-      return nullptr;
+  out << std::left << std::setw(20) << "stage" << std::right << std::setw(12) << "seconds"
+      << std::setw(14) << "bytes" << std::setw(12) << "MB/s" << '\n' << std::fixed;
+  for (const auto& [name, stage] : stages) {
+    if (ran(*stage)) {
+      out << std::left << std::setw(20) << name << std::right << std::setprecision(6)
+          << std::setw(12) << stage->seconds << std::setw(14) << stage->bytes << std::setprecision(1)
+          << std::setw(12) << (stage->seconds == 0 ? 0.0 : stage->bytes / stage->seconds / 1e6) << '\n';
     }
+  }
+  out << std::left << std::setw(20) << "total" << std::right << std::setprecision(6)
+      << std::setw(12) << seconds << '\n'
+      << "input bytes: " << stats.input_bytes << '\n'
+      << "output bytes: " << stats.output_bytes << '\n'
+      << "blocks: " << stats.blocks << '\n'
+      << "stored blocks: " << stats.stored_blocks << '\n'
+      << "reused blocks: " << stats.reused_blocks << '\n'
+      << "context blocks: " << stats.context_blocks << '\n'
+      << "symbols: " << stats.symbols << '\n' << std::setprecision(3);
+  if (measured) {
+    out << "distinct symbols: " << stats.distinct_symbols << '\n'
+        << "average code length: " << double(stats.code_bits) / stats.symbols << " bits\n"
+        << "entropy: " << stats.entropy_bits / stats.symbols << " bits/symbol\n";
+  }
+  if (achieved) {
+    out << "achieved: " << compressed_bytes * 8.0 / stats.symbols << " bits/symbol\n";
+  }
+  out << "peak memory: " << peak_memory << " bytes\n";
+}
 
-    Node *node;
-#pragma GCC diagnostic push
-    // You're wrong, GCC. You're WRONG.
-#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
-    if (is_leaf) {
-#pragma GCC diagnostic pop
-      Symbol symbol;
-      in >> symbol;
-      if (!in) {
-        return nullptr;
-      }
-      node = new Node{
-        .weight = 0, // unused
-        .type = Node::Type::leaf,
-        .leaf = symbol
-      };
-    } else {
-      // It's an internal node.
-      node = new Node{
-        .weight = 0, // unused
-        .type = Node::Type::internal,
-        .internal = {
-          .id = next_node_id++,
-          .left = nullptr, // TBD
-          .right = nullptr // TBD
-        }
-      };
-      ancestors.push_back(node);
-    }
-
-    if (parent->internal.left == nullptr) {
-      parent->internal.left = node;
-    } else {
-      parent->internal.right = node;
+int main_graph(const char *input_path, const Options& options, std::ostream& out) {
+  MappedFile file;
+  Symbols symbols{options.symbol_size};
+  if (input_path) {
+    if (!file.open(input_path)) {
+      return 1;
     }
-  } while (!ancestors.empty());
+    symbols = read_symbols(file.data(), file.size(), options.symbol_size, options.threads);
+  } else {
+    symbols = read_symbols(std::cin, options.symbol_size, options.threads);
+  }
+  const Tree tree = build_tree(symbols);
+  if (tree.empty()) {
+    return 0;
+  }
+  graph_tree(out, tree, symbols.extra, options.symbol_size);
+  return 0;
+}
 
-  return root;
+// Return whether the specified `symbols` can be given code words no longer
+// than the specified `max_code_length`. If not, print a diagnostic to standard
+// error.
+bool check_symbol_count(const Symbols& symbols, int max_code_length) {
+  if (!can_encode(symbols, max_code_length)) {
+    std::cerr << "There are " << symbols.info.size()
+              << " distinct symbols, which is too many for a maximum code length of "
+              << max_code_length << ".\n";
+    return false;
+  }
+  return true;
 }
 
-int main_graph(const char *input_path, std::ostream& out) {
-  std::ifstream fin;
-  std::streambuf *buf;
+// Load into the specified `table` the table file at the specified `path`.
+// Return whether successful.
+bool read_table(const char *path, CodeTable& table) {
+  MappedFile file;
+  return file.open(path) && read_table(file.data(), file.size(), table);
+}
+
+
+// Build a code table (see `CodeTable`) from the symbols of the optionally
+// specified `input_path`, or of standard input if `input_path` is null, and
+// write the table file to the specified `out`. Return zero on success or a
+// nonzero value if an error occurs.
+int main_train(const char *input_path, const Options& options, std::ostream& out) {
+  MappedFile file;
+  Symbols symbols{options.symbol_size};
   if (input_path) {
-    fin.open(input_path);
-    if (!fin) {
+    if (!file.open(input_path)) {
       return 1;
     }
-    buf = fin.rdbuf();
+    symbols = read_symbols(file.data(), file.size(), options.symbol_size, options.threads);
   } else {
-    buf = std::cin.rdbuf();
+    symbols = read_symbols(std::cin, options.symbol_size, options.threads);
   }
-  std::istream in{buf};
+  // One code word of the longest length is needed for the escape.
+  if (!check_symbol_count(symbols, options.max_code_length - 1)) {
+    return 2;
+  }
+  const std::vector<CodeLength> lengths = build_table_lengths(symbols, options.max_code_length);
+
+  out.write(table_magic, sizeof table_magic);
+  out.put(char(options.symbol_size - 1));
+  OutputBitStream bitout{*out.rdbuf()};
+  write_code_lengths(bitout, lengths, options.symbol_size);
+  if (!bitout.flush_byte()) {
+    return 3;
+  }
+  return 0;
+}
+
+// Encode the specified `size` bytes at the specified `data` using the
+// specified `table`, and write the result to the specified `out` in version 4
+// of the format (see `write_version4`), and add measurements to the
+// specified `stats`. Return zero on success or a nonzero value if an error
+// occurs.
+int main_encode_table(const char *data, std::size_t size, const CodeTable& table, std::ostream& out, Stats& stats) {
+  Stopwatch watch;
+  Symbols symbols{table.symbol_size};
+  CodeBook code_book;
+  CodeWord escape{};
+  assign_table(table, symbols, code_book, escape);
+  stats.build_code_words.add(watch.lap(), size);
+  OutputBitStream bitout{*out.rdbuf()};
+  write_version4(bitout, data, size, table, code_book, escape);
+  if (!bitout.flush_byte()) {
+    return 3;
+  }
+  stats.encode.add(watch.lap(), size);
+  stats.input_bytes = size;
+  stats.symbols = size / table.symbol_size;
+  return 0;
+}
+
+// `BlockCode` is the code of a block that has code lengths, kept for the
+// blocks after it to reuse (see `BlockKind::huffman_reuse`). Each of
+// `symbols` has its code word, and `code_book` refers to `symbols`.
+struct BlockCode {
+  Symbols symbols;
+  std::vector<CodeLength> lengths;
+  CodeBook code_book;
+};
 
-  Symbols symbols = read_symbols(in);
-  Tree tree = build_tree(symbols);
-  if (tree == nullptr) {
+// `SharedCode` is the code in effect after a block, or null if no block so
+// far has code lengths. Blocks encoded concurrently share it only to read it.
+using SharedCode = std::shared_ptr<BlockCode>;
+
+// Return the number of bits that the code words of the specified `symbols`
+// occupy in the specified `code`, or return the maximum value if some symbol
+// has no code word in `code`.
+std::uint64_t reused_code_bits(const Symbols& symbols, const BlockCode& code) {
+  std::uint64_t bits = 0;
+  for (const SymbolTable::Entry& entry : symbols.info) {
+    const SymbolInfo *info = code.symbols.info.find(entry.symbol);
+    if (!info || info->code_word.length == 0) {
+      return std::numeric_limits<std::uint64_t>::max();
+    }
+    bits += entry.info.frequency * info->code_word.length;
+  }
+  return bits;
+}
+
+// Encode the specified `size` bytes at the specified `data` as the <encoded>
+// part of a block (see `BlockKind`), append the result to the specified
+// `encoded`, assign the block's kind to the specified `kind`, and add
+// measurements to the specified `stats`. Return zero on success or a nonzero
+// value if an error occurs. The block is divided into `options.streams`
+// streams if there are at least that many symbols. The block reuses the code
+// in effect after the block before it, which is the specified `previous`, if
+// that is no larger than the block's own code and code lengths. If
+// `options.context` is one, then the block is coded in an order-1 model
+// instead if that is smaller still, unless the block is divided into streams.
+// The block is stored instead (see `BlockKind::stored`) if no code would make
+// it smaller. The code in effect after the block is assigned to the specified
+// `next` as soon as it is known, unless an error occurs first.
+int encode_block(const char *data, std::size_t size, const Options& options, const std::shared_future<SharedCode>& previous, std::promise<SharedCode>& next, BlockKind& kind, std::string& encoded, Stats& stats) {
+  const std::size_t symbol_size = options.symbol_size;
+  Stopwatch watch;
+  const SharedCode own = std::make_shared<BlockCode>(
+    BlockCode{.symbols = read_symbols(data, size, symbol_size, 1), .lengths = {}, .code_book = {}});
+  Symbols& symbols = own->symbols;
+  stats.read_symbols.add(watch.lap(), size);
+  if (!check_symbol_count(symbols, options.max_code_length)) {
+    return 2;
+  }
+  const std::uint64_t symbol_count = size / symbol_size;
+  const bool streamed = options.streams >= 2 && symbol_count >= options.streams;
+
+  // Build the block's own code unless the entropy of its symbols rules out
+  // that the code would make the block smaller, which is cheaper to find out.
+  constexpr std::uint64_t unknown = std::numeric_limits<std::uint64_t>::max();
+  std::uint64_t own_code_bits = unknown;
+  std::uint64_t own_bits = unknown;
+  if (min_coded_bits(symbols) < 8.0 * size) {
+    own->lengths = build_code_lengths(symbols, options.max_code_length);
+    sort_canonical(own->lengths);
+    stats.build_code_lengths.add(watch.lap(), size);
+    own_code_bits = code_words_bits(symbols, own->lengths);
+    own_bits = code_lengths_bits(own->lengths, symbol_size) + own_code_bits;
+  }
+  // No context has more distinct symbols than the whole block, so the symbol
+  // count needn't be checked again.
+  std::vector<Symbols> context_symbols;
+  std::vector<std::vector<CodeLength>> context_lengths;
+  std::uint64_t context_code_bits = unknown;
+  std::uint64_t context_bits = unknown;
+  if (options.context == 1 && !streamed && symbol_count != 0) {
+    // The block's bytes were already counted by the stages above, unless its
+    // own code wasn't built, so usually only the time is added.
+    context_symbols = read_context_symbols(data, symbol_count * symbol_size, symbol_size);
+    stats.read_symbols.add(watch.lap(), 0);
+    context_lengths = build_context_code_lengths(context_symbols, options.max_code_length);
+    stats.build_code_lengths.add(watch.lap(), own_bits == unknown ? size : 0);
+    context_code_bits = 0;
+    for (std::size_t context = 0; context < context_count; ++context) {
+      context_code_bits += code_words_bits(context_symbols[context], context_lengths[context]);
+    }
+    context_bits = context_code_lengths_bits(context_lengths, symbol_size) + context_code_bits;
+  }
+  // Only this depends on the blocks before this one, so blocks are otherwise
+  // encoded concurrently.
+  const SharedCode previous_code = previous.get();
+  const std::uint64_t reused_bits = previous_code ? reused_code_bits(symbols, *previous_code) : unknown;
+  const bool contextual = context_bits < std::min(own_bits, reused_bits);
+  const bool reuse = !contextual && reused_bits <= own_bits;
+  const std::uint64_t code_bits = contextual ? context_code_bits : reuse ? reused_bits : own_code_bits;
+  const std::uint64_t best_bits = std::min({own_bits, reused_bits, context_bits});
+  // Each stream is padded to a whole byte and has its size in the header.
+  const std::uint64_t overhead = (streamed ? 1 + options.streams * 9 : 0) + symbols.extra.size();
+  if (best_bits == unknown || (best_bits + 7) / 8 + overhead >= size) {
+    next.set_value(previous_code);
+    if (options.stats != StatsFormat::none) {
+      measure_code(symbols, symbol_count * symbol_size * 8, stats);
+      watch.lap();
+    }
+    kind = BlockKind::stored;
+    encoded.append(data, size);
+    stats.encode.add(watch.lap(), size);
+    ++stats.stored_blocks;
+    return 0;
+  }
+  std::optional<ContextCodeBook> context_book;
+  if (contextual) {
+    next.set_value(previous_code);
+    context_book.emplace(context_symbols, context_lengths);
+    stats.build_code_words.add(watch.lap(), size);
+    ++stats.context_blocks;
+  } else if (reuse) {
+    next.set_value(previous_code);
+    ++stats.reused_blocks;
+  } else {
+    own->code_book.assign(symbols, own->lengths);
+    // The code words are needed in `symbols` to find the cost of reusing
+    // them, even where the code book doesn't keep them there.
+    build_code_words(symbols, own->lengths);
+    next.set_value(own);
+    stats.build_code_words.add(watch.lap(), size);
+  }
+  CodeBook& code_book = reuse ? previous_code->code_book : own->code_book;
+  if (options.stats != StatsFormat::none) {
+    measure_code(symbols, code_bits, stats);
+    watch.lap();
+  }
+
+  if (!streamed) {
+    kind = contextual ? BlockKind::huffman_context : reuse ? BlockKind::huffman_reuse : BlockKind::huffman;
+    std::stringbuf buffer;
+    OutputBitStream bitout{buffer};
+    if (contextual) {
+      write_context_code_lengths(bitout, context_lengths, symbol_size);
+      stats.write_code_lengths.add(watch.lap(), size);
+      context_book->encode(bitout, data, size - symbols.extra.size());
+    } else {
+      if (!reuse) {
+        write_code_lengths(bitout, own->lengths, symbol_size);
+        stats.write_code_lengths.add(watch.lap(), size);
+      }
+      code_book.encode(bitout, data, size - symbols.extra.size());
+    }
+    for (const char byte : symbols.extra) {
+      bitout << byte;
+    }
+    if (!bitout.flush_byte()) {
+      return 3;
+    }
+    encoded += buffer.view();
+    stats.encode.add(watch.lap(), size);
     return 0;
   }
-  graph_tree(out, *tree, symbols.extra);
+
+  kind = reuse ? BlockKind::huffman_streams_reuse : BlockKind::huffman_streams;
+  const std::uint64_t per_stream = symbol_count / options.streams;
+  std::vector<std::string> streams(options.streams);
+  for (unsigned i = 0; i < options.streams; ++i) {
+    const std::uint64_t count = i + 1 == options.streams ? symbol_count - i * per_stream : per_stream;
+    std::stringbuf buffer;
+    OutputBitStream bitout{buffer};
+    code_book.encode(bitout, data + i * per_stream * symbol_size, count * symbol_size);
+    if (!bitout.flush_byte()) {
+      return 3;
+    }
+    streams[i] = std::move(buffer).str();
+  }
+  stats.encode.add(watch.lap(), size);
+
+  std::stringbuf buffer;
+  std::ostream out{&buffer};
+  out.put(char(options.streams));
+  for (const std::string& stream : streams) {
+    write_u64(out, stream.size());
+  }
+  if (!reuse) {
+    OutputBitStream bitout{buffer};
+    write_code_lengths(bitout, own->lengths, symbol_size);
+    stats.write_code_lengths.add(watch.lap(), size);
+  }
+  for (const std::string& stream : streams) {
+    out << stream;
+  }
+  out << symbols.extra;
+  if (!out) {
+    return 3;
+  }
+  encoded += buffer.view();
+  stats.encode.add(watch.lap(), 0);
   return 0;
 }
 
-int main_encode(const char *input_path, std::ostream& out) {
-  std::ifstream in{input_path};
-  if (!in) {
+// Write to the specified `out` a block of the specified `kind` having the
+// specified `decoded_size` and `encoded` part.
+std::ostream& write_block(std::ostream& out, BlockKind kind, std::uint64_t decoded_size, std::string_view encoded) {
+  out.put(char(kind));
+  write_u64(out, decoded_size);
+  write_u64(out, encoded.size());
+  return out.write(encoded.data(), encoded.size());
+}
+
+// `InputBlock` is a block of input to be encoded. Its `size` bytes at `data`
+// are either in `storage` or in memory that outlives the encoding.
+struct InputBlock {
+  std::vector<char> storage;
+  const char *data;
+  std::size_t size;
+};
+
+// Encode the input as a sequence of blocks, each having the decoded size
+// `options.block_size`, except possibly the last, and write the result to the
+// specified `out`. The specified `read_block` is invoked as
+// `read_block(block_size, block)` to assign the next at most `block_size`
+// bytes of input to `block`, where a block of size zero indicates the end of
+// the input. Up to `options.threads` blocks are encoded concurrently, and each
+// block is written as soon as it and the blocks before it are encoded. If
+// `options.index`, then the blocks are followed by an index. Add
+// measurements of the blocks to the specified `stats`.
+template <typename ReadBlock>
+int encode_blocks(ReadBlock&& read_block, const Options& options, std::ostream& out, Stats& stats) {
+  // Blocks are a whole number of symbols, so that only the last block can
+  // have "extra."
+  const std::size_t symbol_size = options.symbol_size;
+  const std::uint64_t block_size = std::max<std::uint64_t>(
+    symbol_size, options.block_size - options.block_size % symbol_size);
+
+  struct Encoded {
+    int rc;
+    BlockKind kind;
+    std::uint64_t decoded_size;
+    std::string encoded;
+    Stats stats;
+  };
+  std::deque<std::future<Encoded>> pending;
+  std::size_t in_flight;
+  const std::launch policy = block_policy(options, in_flight);
+  std::vector<IndexEntry> index;
+  IndexEntry next{.offset = file_header_size, .decoded_offset = 0};
+  // `code` is the code in effect after the most recently read block.
+  std::promise<SharedCode> no_code;
+  no_code.set_value(nullptr);
+  std::shared_future<SharedCode> code = no_code.get_future().share();
+  const auto write_oldest = [&]() {
+    const Encoded block = pending.front().get();
+    pending.pop_front();
+    if (block.rc == 0) {
+      write_block(out, block.kind, block.decoded_size, block.encoded).flush();
+      index.push_back(next);
+      next.offset += block_header_size + block.encoded.size();
+      next.decoded_offset += block.decoded_size;
+      stats += block.stats;
+      stats.input_bytes += block.decoded_size;
+      ++stats.blocks;
+    }
+    return block.rc;
+  };
+
+  out << "huffer3" << '\0' << char(symbol_size - 1);
+  for (;;) {
+    InputBlock block;
+    read_block(block_size, block);
+    const std::size_t size = block.size;
+    if (size == 0) {
+      break;
+    }
+    std::promise<SharedCode> next_code;
+    std::shared_future<SharedCode> previous = std::exchange(code, next_code.get_future().share());
+    pending.push_back(std::async(policy, [&options, block = std::move(block), previous = std::move(previous), next_code = std::move(next_code)]() mutable {
+      Encoded result{.rc = 0, .kind = BlockKind::end, .decoded_size = block.size, .encoded = {}, .stats = {}};
+      result.rc = encode_block(block.data, block.size, options, previous, next_code, result.kind, result.encoded, result.stats);
+      return result;
+    }));
+    while (pending.size() > in_flight) {
+      if (int rc = write_oldest()) {
+        return rc;
+      }
+    }
+    if (size < block_size) {
+      break;
+    }
+  }
+  while (!pending.empty()) {
+    if (int rc = write_oldest()) {
+      return rc;
+    }
+  }
+  out.put(char(BlockKind::end));
+
+  if (options.index) {
+    for (const IndexEntry& entry : index) {
+      write_u64(out, entry.offset);
+      write_u64(out, entry.decoded_offset);
+    }
+    write_u64(out, index.size());
+    out.write(index_magic, sizeof index_magic);
+  }
+  return out ? 0 : 3;
+}
+
+// Encode the specified `in` as a sequence of blocks. See `encode_blocks`. If
+// `options.auto_symbol_size`, then the symbol size is chosen from the first
+// `options.block_size` bytes of `in`.
+int main_encode_blocks(std::istream& in, const Options& options, std::ostream& out, Stats& stats) {
+  Options resolved = options;
+  // `prefix` is the input read to choose the symbol size, which is encoded
+  // before the rest of `in`.
+  std::vector<char> prefix;
+  if (options.auto_symbol_size) {
+    prefix.resize(options.block_size);
+    in.read(prefix.data(), prefix.size());
+    prefix.resize(in.gcount());
+    resolved.symbol_size = choose_symbol_size(prefix.data(), prefix.size(), options.max_code_length);
+  }
+  std::size_t prefix_offset = 0;
+  return encode_blocks([&](std::uint64_t block_size, InputBlock& block) {
+    block.storage.resize(block_size);
+    const std::size_t from_prefix = std::min<std::uint64_t>(block_size, prefix.size() - prefix_offset);
+    std::memcpy(block.storage.data(), prefix.data() + prefix_offset, from_prefix);
+    prefix_offset += from_prefix;
+    in.read(block.storage.data() + from_prefix, block_size - from_prefix);
+    block.data = block.storage.data();
+    block.size = from_prefix + in.gcount();
+  }, resolved, out, stats);
+}
+
+// Encode the specified `size` bytes at the specified `data` as a sequence of
+// blocks, without copying them. See `encode_blocks`.
+int main_encode_blocks(const char *data, std::size_t size, const Options& options, std::ostream& out, Stats& stats) {
+  std::size_t offset = 0;
+  return encode_blocks([&](std::uint64_t block_size, InputBlock& block) {
+    block.data = data + offset;
+    block.size = std::min<std::uint64_t>(block_size, size - offset);
+    offset += block.size;
+  }, options, out, stats);
+}
+
+// Return the size of the specified `size` bytes of input, which has symbols
+// of the specified `symbol_size`, when encoded by `encode_stored`.
+std::uint64_t stored_file_size(std::uint64_t size, std::size_t symbol_size) {
+  const std::uint64_t block_size = max_block_size - max_block_size % symbol_size;
+  const std::uint64_t blocks = (size + block_size - 1) / block_size;
+  return file_header_size + blocks * block_header_size + size + 1;
+}
+
+// Write to the specified `out` the specified `size` bytes at the specified
+// `data` in version 3 of the format, as blocks of kind `BlockKind::stored`,
+// of symbols of the specified `symbol_size`. Return zero on success or a
+// nonzero value if an error occurs.
+int encode_stored(const char *data, std::uint64_t size, std::size_t symbol_size, std::ostream& out) {
+  // As with coded blocks, only the last block can have "extra."
+  const std::uint64_t block_size = max_block_size - max_block_size % symbol_size;
+  out << "huffer3" << '\0' << char(symbol_size - 1);
+  for (std::uint64_t offset = 0; offset < size; offset += block_size) {
+    const std::uint64_t length = std::min(block_size, size - offset);
+    write_block(out, BlockKind::stored, length, std::string_view{data + offset, length});
+  }
+  out.put(char(BlockKind::end));
+  return out ? 0 : 3;
+}
+
+int main_encode(const char *input_path, const Options& options, std::ostream& out, Stats& stats) {
+  if (options.table) {
+    CodeTable table;
+    if (!read_table(options.table, table)) {
+      return 12;
+    }
+    MappedFile file;
+    if (input_path ? !file.open(input_path) : !file.open(STDIN_FILENO)) {
+      return 1;
+    }
+    return main_encode_table(file.data(), file.size(), table, out, stats);
+  }
+
+  // Standard input can't be read twice, and only blocks can be divided into
+  // streams, indexed, or coded in context, so those use blocks even if no
+  // block size was specified. `resolved` is `options` with the block size
+  // and the symbol size settled.
+  Options resolved = options;
+  if (resolved.block_size == 0 && (!input_path || options.streams > 1 || options.index || options.context != 0)) {
+    resolved.block_size = default_block_size;
+  }
+  if (!input_path) {
+    return main_encode_blocks(std::cin, resolved, out, stats);
+  }
+
+  MappedFile file;
+  if (!file.open(input_path)) {
     return 1;
   }
+  if (options.auto_symbol_size) {
+    resolved.symbol_size = choose_symbol_size(file.data(), file.size(), options.max_code_length);
+    resolved.auto_symbol_size = false;
+  }
+  if (resolved.block_size != 0) {
+    return main_encode_blocks(file.data(), file.size(), resolved, out, stats);
+  }
 
-  Symbols symbols = read_symbols(in);
-  Tree tree = build_tree(symbols);
-  build_code_words(symbols, tree.get());
+  const std::size_t size = file.size();
+  const std::size_t symbol_size = resolved.symbol_size;
+  stats.input_bytes = size;
+  Stopwatch watch;
+  Symbols symbols = read_symbols(file.data(), size, symbol_size, options.threads);
+  stats.read_symbols.add(watch.lap(), size);
+  if (!check_symbol_count(symbols, options.max_code_length)) {
+    return 2;
+  }
+  // If coding wouldn't make the input smaller, then store it instead, which
+  // requires version 3 of the format. See `encode_block`.
+  const std::uint64_t stored_size = stored_file_size(size, symbol_size);
+  const auto store = [&]() {
+    if (options.stats != StatsFormat::none) {
+      measure_code(symbols, (size - symbols.extra.size()) * 8, stats);
+      watch.lap();
+    }
+    const int rc = encode_stored(file.data(), size, symbol_size, out);
+    stats.encode.add(watch.lap(), size);
+    stats.blocks = stats.stored_blocks = (stored_size - file_header_size - size - 1) / block_header_size;
+    return rc;
+  };
+  // The header of version 2 is the magic, 64 bits of size, and 3 bits of
+  // symbol size.
+  const std::uint64_t header_bits = 8 * 8 + 64 + 3;
+  const std::uint64_t extra_bits = symbols.extra.size() * 8;
+  if (header_bits + min_coded_bits(symbols) + extra_bits >= 8.0 * stored_size) {
+    return store();
+  }
+  std::vector<CodeLength> lengths = build_code_lengths(symbols, options.max_code_length);
+  sort_canonical(lengths);
+  stats.build_code_lengths.add(watch.lap(), size);
+  const std::uint64_t code_bits = code_words_bits(symbols, lengths);
+  if ((header_bits + code_lengths_bits(lengths, symbol_size) + code_bits + extra_bits + 7) / 8 >= stored_size) {
+    return store();
+  }
+  CodeBook code_book{symbols, lengths};
+  stats.build_code_words.add(watch.lap(), size);
+  if (options.stats != StatsFormat::none) {
+    measure_code(symbols, code_bits, stats);
+    watch.lap();
+  }
 
-  // Write the header and the tree.
-  out << "huffer1" << '\0';
+  // Start from the beginning of input again, and encode it.
   OutputBitStream bitout{*out.rdbuf()};
-  bitout << std::bitset<64>{symbols.total_size} << std::bitset<3>{symbol_size - 1};
-  write_tree(bitout, tree.get());
+  write_version2_header(bitout, symbols, lengths);
+  stats.write_code_lengths.add(watch.lap(), size);
+  write_version2_code_words(bitout, file.data(), symbols, code_book);
+  if (!bitout.flush_byte()) {
+    return 3;
+  }
+  stats.encode.add(watch.lap(), size);
+  return 0;
+}
 
-  // Start from the beginning of input again, and encode it.
-  in.clear();
-  in.seekg(0, std::ios::beg);
-  Symbol buffer;
-  for (;;) {
-    in.read(buffer.data(), buffer.size());
-    const int count = in.gcount();
-    if (count < int(symbol_size)) {
-      // We reached the "extra." Copy it verbatim (unencoded).
-      for (int i = 0; i < count; ++i) {
-        bitout << buffer[i];
+// `batch_suffix` is appended to the path of each file compressed by
+// `main_encode_batch` to name its compressed file.
+constexpr std::string_view batch_suffix = ".huf";
+
+// Assign to the specified `paths` the files named by the specified `batch`:
+// if `batch` is a directory, then the regular files in it, in order of name,
+// except those that end with `batch_suffix`; and otherwise the nonempty lines
+// of the file at `batch`, or of standard input if `batch` is null. Return
+// whether successful.
+bool list_batch(const char *batch, std::vector<std::string>& paths) {
+  std::error_code error;
+  if (batch && std::filesystem::is_directory(batch, error)) {
+    for (const auto& entry : std::filesystem::directory_iterator(batch, error)) {
+      const std::string path = entry.path().string();
+      if (entry.is_regular_file(error) && !path.ends_with(batch_suffix)) {
+        paths.push_back(path);
       }
-      break;
     }
+    std::sort(paths.begin(), paths.end());
+    return !error;
+  }
 
-    bitout << symbols.info[buffer].code_word;
+  MappedFile list;
+  if (batch ? !list.open(batch) : !list.open(STDIN_FILENO)) {
+    return false;
   }
+  std::string_view rest{list.data(), list.size()};
+  while (!rest.empty()) {
+    const std::string_view line = rest.substr(0, rest.find('\n'));
+    rest.remove_prefix(std::min(rest.size(), line.size() + 1));
+    if (!line.empty()) {
+      paths.emplace_back(line);
+    }
+  }
+  return true;
+}
 
+// Compress the file at the specified `input_path` as `main_encode` does, into
+// a new file at the specified `output_path`, which is removed if an error
+// occurs. Add measurements to the specified `stats`. Return zero on success
+// or a nonzero value if an error occurs.
+int encode_file(const char *input_path, const char *output_path, const Options& options, Stats& stats) {
+  const int fd = ::open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    return 11;
+  }
+  DescriptorBuf buffer{fd};
+  std::ostream out{&buffer};
+  int rc = main_encode(input_path, options, out, stats);
+  if (!out.flush() && rc == 0) {
+    rc = 11;
+  }
+  stats.output_bytes += buffer.bytes_written();
+  if (::close(fd) != 0 && rc == 0) {
+    rc = 11;
+  }
+  if (rc != 0) {
+    ::unlink(output_path);
+  }
+  return rc;
+}
+
+// Compress each of the files named by the specified `batch` (see
+// `list_batch`) as `main_encode` does, each into a file whose path is the
+// file's followed by `batch_suffix`. Up to `options.threads` files are
+// compressed concurrently, each by a single thread, so that reading,
+// counting, encoding, and writing overlap across files without the cost of
+// a process for each. Add measurements of every file to the specified
+// `stats`. Return zero if every file is compressed, or otherwise the error of
+// the first file in the batch that isn't, after attempting the rest.
+int main_encode_batch(const char *batch, const Options& options, Stats& stats) {
+  std::vector<std::string> paths;
+  if (!list_batch(batch, paths)) {
+    return 1;
+  }
+
+  Options single = options;
+  single.threads = 1;
+  std::atomic<std::size_t> next{0};
+  std::vector<int> results(paths.size());
+  std::mutex mutex;
+  const auto work = [&]() {
+    Stats worker_stats;
+    for (std::size_t i; (i = next++) < paths.size();) {
+      const std::string output_path = paths[i] + std::string(batch_suffix);
+      results[i] = encode_file(paths[i].c_str(), output_path.c_str(), single, worker_stats);
+      if (results[i] != 0) {
+        std::lock_guard lock{mutex};
+        std::cerr << "Unable to compress " << paths[i] << " (error " << results[i] << ").\n";
+      }
+    }
+    std::lock_guard lock{mutex};
+    stats += worker_stats;
+  };
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < std::min<std::size_t>(options.threads, paths.size()); ++i) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+
+  for (const int rc : results) {
+    if (rc != 0) {
+      return rc;
+    }
+  }
   return 0;
 }
 
-int main_decode(const char *input_path, std::ostream& out) {
-  std::ifstream fin;
+
+// Decode from the specified `in`, which is positioned just after the magic
+// of version 3 of the format, the blocks that follow, and write the part of
+// the result described by `options.range_offset` and `options.range_length`
+// to the specified `out`. Blocks outside of that part are skipped without
+// being decoded. If the specified `index` is not empty, then it is the
+// file's index, and `in` supports seeking, so the blocks before the part are
+// not read either, except for the one whose code the first block in the part
+// reuses, if any. Up to `options.threads` blocks are decoded concurrently,
+// and each block is written and flushed as soon as it and the blocks before it
+// are decoded, by a separate thread, so that reading the next block, decoding,
+// and writing all overlap, even with one thread. Few enough blocks are read
+// ahead that memory stays bounded. Add measurements of the decoded blocks to
+// the specified `stats`.
+int decode_blocks(std::istream& in, const std::vector<IndexEntry>& index, const Options& options, std::ostream& out, Stats& stats) {
+  char raw_symbol_size;
+  if (!in.get(raw_symbol_size)) {
+    return 5;
+  }
+  const std::size_t symbol_size = std::uint8_t(raw_symbol_size) + 1;
+  if (symbol_size > max_symbol_size) {
+    return 6;
+  }
+
+  // `position` is the decoded offset of the next block.
+  std::uint64_t position = 0;
+  const std::uint64_t range_begin = options.range_offset;
+  const std::uint64_t range_end = range_begin +
+    std::min(options.range_length, std::numeric_limits<std::uint64_t>::max() - range_begin);
+  // Start at the last block that begins no later than the range, or before
+  // that at the block whose code it would reuse.
+  auto first = std::upper_bound(index.begin(), index.end(), range_begin,
+    [](std::uint64_t offset, const IndexEntry& entry) { return offset < entry.decoded_offset; });
+  for (char kind; first != index.begin(); --first) {
+    if (!in.seekg(first[-1].offset) || !in.get(kind)) {
+      return 9;
+    }
+    if (kind == char(BlockKind::huffman) || kind == char(BlockKind::huffman_streams) || first - 1 == index.begin()) {
+      if (!in.seekg(first[-1].offset)) {
+        return 9;
+      }
+      position = first[-1].decoded_offset;
+      break;
+    }
+  }
+
+  struct Decoded {
+    int rc;
+    std::string decoded;
+    // `begin` and `end` delimit the part of `decoded` within the range.
+    std::uint64_t begin;
+    std::uint64_t end;
+    Stats stats;
+  };
+  std::deque<std::future<Decoded>> pending;
+  std::size_t in_flight;
+  const std::launch policy = block_policy(options, in_flight);
+  // `writer` writes the `pending` blocks in order, until it is stopped or a
+  // block fails, whose error it then assigns to `write_rc`. Only `writer`
+  // removes blocks from `pending`, so the oldest can be waited for without
+  // holding `mutex`.
+  std::mutex mutex;
+  std::condition_variable_any changed;
+  int write_rc = 0;
+  std::jthread writer([&](std::stop_token stop) {
+    std::unique_lock lock{mutex};
+    while (changed.wait(lock, stop, [&]() { return !pending.empty(); })) {
+      std::future<Decoded>& oldest = pending.front();
+      lock.unlock();
+      const Decoded block = oldest.get();
+      if (block.rc == 0) {
+        out.write(block.decoded.data() + block.begin, block.end - block.begin).flush();
+        stats += block.stats;
+      }
+      lock.lock();
+      pending.pop_front();
+      write_rc = block.rc;
+      changed.notify_all();
+      if (write_rc) {
+        return;
+      }
+    }
+  });
+  // `code` is the code in effect after the most recently read block, or is
+  // invalid if it's `skipped`, the last block before the range that has code
+  // lengths, whose code is then found only if a block reuses it.
+  using SharedTable = std::shared_ptr<DecodeTable>;
+  std::shared_future<SharedTable> code;
+  struct Skipped {
+    BlockKind kind;
+    std::uint64_t decoded_size;
+    std::string encoded;
+  };
+  std::optional<Skipped> skipped;
+
+  while (position < range_end) {
+    char kind;
+    if (!in.get(kind)) {
+      return 9;
+    }
+    if (kind == char(BlockKind::end)) {
+      break;
+    }
+    if (!is_data_block(kind)) {
+      return 10;
+    }
+    std::uint64_t decoded_size = 0;
+    std::uint64_t encoded_size = 0;
+    if (!read_u64(in, decoded_size) || !read_u64(in, encoded_size)) {
+      return 9;
+    }
+    if (decoded_size > max_block_size || encoded_size > max_encoded_size(decoded_size) ||
+        (kind == char(BlockKind::stored) && encoded_size != decoded_size)) {
+      return 10;
+    }
+    const std::uint64_t block_begin = position;
+    position += decoded_size;
+    const bool coded = kind == char(BlockKind::huffman) || kind == char(BlockKind::huffman_streams);
+    if (position <= range_begin && !coded) {
+      if (!skip(in, encoded_size)) {
+        return 9;
+      }
+      continue;
+    }
+    std::string encoded(encoded_size, '\0');
+    if (!in.read(encoded.data(), encoded.size())) {
+      return 9;
+    }
+    if (position <= range_begin) {
+      skipped.emplace(Skipped{.kind = BlockKind(kind), .decoded_size = decoded_size, .encoded = std::move(encoded)});
+      code = {};
+      continue;
+    }
+    if (is_reuse_block(BlockKind(kind)) && !code.valid() && skipped) {
+      // Decoding the skipped block is the simplest way to find its code.
+      code = std::async(policy, [skipped = std::move(*skipped), symbol_size]() {
+        SharedTable table = std::make_shared<DecodeTable>();
+        std::string decoded;
+        return decode_block(skipped.kind, skipped.encoded, skipped.decoded_size, symbol_size, *table, decoded) ? nullptr : table;
+      }).share();
+      skipped.reset();
+    }
+    // A block that has code lengths makes its code the one in effect once
+    // the block is decoded.
+    std::shared_future<SharedTable> previous = code;
+    std::promise<SharedTable> next_code;
+    if (coded) {
+      code = next_code.get_future().share();
+      skipped.reset();
+    }
+    const std::uint64_t begin = std::max(block_begin, range_begin) - block_begin;
+    const std::uint64_t end = std::min(position, range_end) - block_begin;
+    std::unique_lock lock{mutex};
+    changed.wait(lock, [&]() { return pending.size() <= in_flight || write_rc; });
+    if (write_rc) {
+      return write_rc;
+    }
+    pending.push_back(std::async(policy, [kind = BlockKind(kind), encoded = std::move(encoded), decoded_size, symbol_size, begin, end, previous = std::move(previous), next_code = std::move(next_code)]() mutable {
+      Decoded result{.rc = 0, .decoded = {}, .begin = begin, .end = end, .stats = {}};
+      Stopwatch watch;
+      if (kind == BlockKind::stored) {
+        // The block is its own decoding.
+        result.decoded = std::move(encoded);
+        ++result.stats.stored_blocks;
+      } else if (is_reuse_block(kind)) {
+        const SharedTable table = previous.valid() ? previous.get() : nullptr;
+        result.rc = table ? decode_block(kind, encoded, decoded_size, symbol_size, *table, result.decoded) : 8;
+        ++result.stats.reused_blocks;
+      } else {
+        SharedTable table = std::make_shared<DecodeTable>();
+        result.rc = decode_block(kind, encoded, decoded_size, symbol_size, *table, result.decoded);
+        next_code.set_value(result.rc ? nullptr : std::move(table));
+      }
+      result.stats.decode.add(watch.lap(), decoded_size);
+      result.stats.blocks = 1;
+      result.stats.symbols = decoded_size / symbol_size;
+      return result;
+    }));
+    lock.unlock();
+    changed.notify_all();
+  }
+  std::unique_lock lock{mutex};
+  changed.wait(lock, [&]() { return pending.empty() || write_rc; });
+  return write_rc;
+}
+
+int main_decode(const char *input_path, const Options& options, std::ostream& unranged, Stats& stats) {
+  MappedFile file;
+  std::optional<ArrayBuf> mapped;
   std::streambuf *buf;
   if (input_path) {
-    fin.open(input_path);
-    if (!fin) {
+    if (!file.open(input_path)) {
       return 1;
     }
-    buf = fin.rdbuf();
+    buf = &mapped.emplace(file.data(), file.size());
+    stats.input_bytes = file.size();
   } else {
     buf = std::cin.rdbuf();
   }
@@ -580,11 +1334,32 @@ int main_decode(const char *input_path, std::ostream& out) {
   if (!in) {
     return 2;
   }
-  const char expected[] = {'h', 'u', 'f', 'f', 'e', 'r', '1', '\0'};
-  if (!std::equal(magic, magic + sizeof magic, expected)) {
+  const int version = format_version(magic);
+  if (version == 0) {
     return 3;
   }
-  InputBitStream bitin{*in.rdbuf()};
+  if (version == 3) {
+    // Only a file in memory can be searched for its index.
+    std::vector<IndexEntry> index;
+    if (input_path && options.range_offset != 0) {
+      index = read_index(file.data(), file.size());
+    }
+    return decode_blocks(in, index, options, unranged, stats);
+  }
+
+  // The other versions can be decoded only from the beginning, so the output
+  // outside of the range is decoded and then discarded.
+  RangeBuf range{*unranged.rdbuf(), options.range_offset, options.range_length};
+  std::ostream out{&range};
+
+  // If the input is in memory, then read bits from it directly.
+  std::optional<InputBitStream> stream;
+  if (input_path) {
+    stream.emplace(file.data() + sizeof magic, file.size() - sizeof magic);
+  } else {
+    stream.emplace(*in.rdbuf());
+  }
+  InputBitStream& bitin = *stream;
   std::bitset<64> raw_total_size;
   bitin >> raw_total_size;
   if (!bitin) {
@@ -596,40 +1371,43 @@ int main_decode(const char *input_path, std::ostream& out) {
     return 5;
   }
   const std::uint64_t total_size = raw_total_size.to_ullong();
-  symbol_size = raw_symbol_size.to_ulong() + 1;
-  if (symbol_size > 8) {
+  const std::size_t symbol_size = raw_symbol_size.to_ulong() + 1;
+  if (symbol_size > max_symbol_size) {
     return 6;
   }
 
-  if (total_size == 0) {
-    return 0; // empty file
+  CodeTable code_table;
+  if (version == 4) {
+    std::bitset<32> fingerprint;
+    if (!(bitin >> fingerprint)) {
+      return 4;
+    }
+    if (!options.table) {
+      return 13;
+    }
+    if (!read_table(options.table, code_table)) {
+      return 12;
+    }
+    if (code_table.fingerprint != fingerprint.to_ulong() || code_table.symbol_size != symbol_size) {
+      return 13;
+    }
   }
 
-  Tree tree = read_tree(bitin);
   // `expanded_size` is the length of the decoded output, excluding any
   // "extra."
   const std::uint64_t expanded_size = total_size - (total_size % symbol_size);
-  for (std::uint64_t bytes_written = 0; bytes_written < expanded_size; bytes_written += symbol_size) {
-    // Read bits until we hit a leaf.
-    const Node *node = tree.get();
-    for (;;) {
-      bool bit;
-      bitin >> bit;
-      if (!bitin) {
-        return 7;
-      }
-      if (node->type == Node::Type::leaf) {
-        // The root is a leaf, so just copy it over.
-        assert(!bit);
-        out << node->leaf;
-        break;
-      }
-      node = bit ? node->internal.right : node->internal.left;
-      if (node->type == Node::Type::leaf) {
-        out << node->leaf;
-        break;
-      }
+  if (expanded_size != 0) {
+    Stopwatch watch;
+    DecodeTable table;
+    if (int rc = read_code(bitin, version, symbol_size, &code_table, table)) {
+      return rc;
+    }
+    stats.read_code.add(watch.lap(), expanded_size);
+    if (!decode_symbols(bitin, table, symbol_size, expanded_size / symbol_size, out)) {
+      return 7;
     }
+    stats.decode.add(watch.lap(), expanded_size);
+    stats.symbols = expanded_size / symbol_size;
   }
 
   // Copy over the remaining "extra" verbatim.
@@ -651,31 +1429,112 @@ std::ostream& usage(std::ostream& out) {
     "  huffer -h\n"
     "    Print this message to standard output.\n"
     "\n"
-    "  huffer encode [--symbol-size=N] FILE\n"
-    "  huffer compress [--symbol-size=N] FILE\n"
+    "  huffer encode [--symbol-size=N] [--max-code-length=N] [--block-size=N]\n"
+    "                [--threads=N] [--streams=N] [--index] [--context=N]\n"
+    "                [--table=FILE] [--batch] [--stats[=json]] [FILE]\n"
+    "  huffer compress [--symbol-size=N] [--max-code-length=N] [--block-size=N]\n"
+    "                  [--threads=N] [--streams=N] [--index] [--context=N]\n"
+    "                  [--table=FILE] [--batch] [--stats[=json]] [FILE]\n"
     "    Compress the specified FILE using a symbol size of N,\n"
-    "    or 1 by default. Print the compressed data to standard\n"
-    "    output.\n"
+    "    or 1 by default, or, if N is auto, the symbol size that\n"
+    "    is estimated from a sample of the input to compress it\n"
+    "    best. Print the compressed data to standard output.\n"
+    "    No code word will be longer than N bits, where N is at\n"
+    "    most 64, or 32 by default. If --block-size is\n"
+    "    specified, or if FILE is not specified, then compress\n"
+    "    the input in a single pass as a sequence of blocks of\n"
+    "    N bytes, or 4194304 bytes by default. Use N threads,\n"
+    "    or 1 by default, to compress blocks or (without blocks)\n"
+    "    to count symbols. Divide each block's code words into\n"
+    "    N streams, at most 16, or 1 by default, which can be\n"
+    "    decompressed in parallel. If --index is specified, then\n"
+    "    follow the blocks with an index for use with --range.\n"
+    "    If --context is 1, rather than 0 by default, then code\n"
+    "    each symbol in the context of the byte before it, with\n"
+    "    a code for each context, where that is smaller.\n"
+    "    Multiple streams, --index, and --context imply blocks.\n"
+    "    If --table is specified, then use the code table in its\n"
+    "    FILE (see train) instead of blocks or a code of the\n"
+    "    input's own. If --batch is specified, then FILE is\n"
+    "    instead a directory or a list of files, one per line,\n"
+    "    and each file in it is compressed to the file's path\n"
+    "    followed by .huf, with N threads compressing N files at\n"
+    "    a time. If --stats is specified, then print the time\n"
+    "    spent in each stage, the entropy of the input and the\n"
+    "    bits per symbol achieved, and peak memory usage to\n"
+    "    standard error, as JSON if --stats=json. If FILE is not\n"
+    "    specified, then read from standard input.\n"
     "\n"
-    "  huffer decode [FILE]\n"
-    "  huffer decompress [FILE]\n"
+    "  huffer decode [--threads=N] [--range=OFFSET:LENGTH] [--table=FILE]\n"
+    "                [--stats[=json]] [FILE]\n"
+    "  huffer decompress [--threads=N] [--range=OFFSET:LENGTH] [--table=FILE]\n"
+    "                    [--stats[=json]] [FILE]\n"
     "    Decompress the optionally specified FILE. Print the\n"
-    "    decompressed data to standard output. If FILE is not\n"
-    "    specified, then read from standard input.\n"
+    "    decompressed data to standard output. Decompress up\n"
+    "    to N blocks at a time, or 1 by default. If --range is\n"
+    "    specified, then print only the LENGTH bytes starting at\n"
+    "    OFFSET, and skip the blocks outside of them, using the\n"
+    "    FILE's index to find the first one if it has an index.\n"
+    "    If FILE was compressed with --table, then --table must\n"
+    "    specify the same table. If --stats is specified, then\n"
+    "    print measurements to standard error as for encode. If\n"
+    "    FILE is not specified, then read from standard input.\n"
+    "\n"
+    "  huffer train [--symbol-size=N] [--max-code-length=N] [--threads=N]\n"
+    "               [FILE]\n"
+    "    Build a code table from the specified FILE, a sample\n"
+    "    of the inputs to be compressed with --table, using a\n"
+    "    symbol size of N, or 1 by default. Print the table to\n"
+    "    standard output. No code word will be longer than N\n"
+    "    bits, or 32 by default. Count symbols with N threads,\n"
+    "    or 1 by default. Symbols that are not in FILE can still\n"
+    "    be compressed, but at a cost. If FILE is not specified,\n"
+    "    then read from standard input.\n"
     "\n"
-    "  huffer graph [--symbol-size=N] [FILE]\n"
+    "  huffer graph [--symbol-size=N] [--threads=N] [FILE]\n"
     "    Create a Huffman tree of the specified FILE using\n"
-    "    a symbol size of N, or 1 by default. Print the graph to\n"
+    "    a symbol size of N, or 1 by default, counting symbols\n"
+    "    with N threads, or 1 by default. Print the graph to\n"
     "    standard output in dot (Graphviz) format. If FILE is not\n"
     "    specified, then read from standard input.\n"
     "\n";
 }
 
+// If the specified `chunk` begins with the specified `prefix`, then parse the
+// rest of `chunk` as a decimal integer into the specified `value` and return
+// `true`. Otherwise, return `false`. If parsing fails or the integer is outside
+// of the range `[low, high]`, then set the specified `valid` to `false`.
+template <typename Integer>
+bool parse_option(std::string_view chunk, std::string_view prefix, Integer low, Integer high, Integer& value, bool& valid) {
+  if (!chunk.starts_with(prefix)) {
+    return false;
+  }
+  chunk.remove_prefix(prefix.size());
+  const auto result = std::from_chars(chunk.data(), chunk.data() + chunk.size(), value);
+  valid = result.ec == std::errc{} && result.ptr == chunk.data() + chunk.size() &&
+          value >= low && value <= high;
+  return true;
+}
+
+// Parse the specified `text` as "OFFSET:LENGTH", two decimal integers, and
+// assign them to the specified `offset` and `length`. Return whether
+// successful.
+bool parse_range(std::string_view text, std::uint64_t& offset, std::uint64_t& length) {
+  const char *const end = text.data() + text.size();
+  const auto first = std::from_chars(text.data(), end, offset);
+  if (first.ec != std::errc{} || first.ptr == end || *first.ptr != ':') {
+    return false;
+  }
+  const auto second = std::from_chars(first.ptr + 1, end, length);
+  return second.ec == std::errc{} && second.ptr == end;
+}
+
 int parse_command_line(
     const char * const *argv,
     bool& help,
     std::string& command,
-    const char *& file) {
+    const char *& file,
+    Options& options) {
   help = false;
 
   const char *const *arg = argv + 1;
@@ -693,25 +1552,84 @@ int parse_command_line(
     return 0;
   }
 
-  if (*arg && (command == "encode" || command == "compress" || command == "graph")) {
-    // Possibly read `--symbol-size=N`.
-    std::string_view chunk = *arg;
-    const std::string_view prefix = "--symbol-size=";
-    if (chunk.starts_with(prefix)) {
-      chunk.remove_prefix(prefix.size());
-      const auto result = std::from_chars(chunk.data(), chunk.data() + chunk.size(), symbol_size);
-      if (result.ec != std::errc{} || result.ptr != chunk.data() + chunk.size()) {
-        usage(std::cerr) << "Invalid symbol size: " << chunk << '\n';
+  const bool encoding = command == "encode" || command == "compress";
+  const bool decoding = command == "decode" || command == "decompress";
+  const bool training = command == "train";
+  for (; *arg && std::string_view(*arg).starts_with("--"); ++arg) {
+    const std::string_view chunk = *arg;
+    bool valid = true;
+    if (encoding && chunk == "--symbol-size=auto") {
+      options.auto_symbol_size = true;
+    } else if ((encoding || training || command == "graph") &&
+        parse_option(chunk, "--symbol-size=", std::size_t(1), max_symbol_size, options.symbol_size, valid)) {
+      options.auto_symbol_size = false;
+      if (!valid) {
+        usage(std::cerr) << "Invalid symbol size: " << chunk.substr(chunk.find('=') + 1) << '\n';
         return -3;
       }
-      ++arg;
+    } else if ((encoding || training) &&
+        parse_option(chunk, "--max-code-length=", 1, longest_code_length, options.max_code_length, valid)) {
+      if (!valid) {
+        usage(std::cerr) << "Invalid maximum code length: " << chunk.substr(chunk.find('=') + 1) << '\n';
+        return -6;
+      }
+    } else if (encoding &&
+        parse_option(chunk, "--block-size=", std::uint64_t(1), max_block_size, options.block_size, valid)) {
+      if (!valid) {
+        usage(std::cerr) << "Invalid block size: " << chunk.substr(chunk.find('=') + 1) << '\n';
+        return -7;
+      }
+    } else if ((encoding || decoding || training || command == "graph") &&
+        parse_option(chunk, "--threads=", 1u, max_threads, options.threads, valid)) {
+      if (!valid) {
+        usage(std::cerr) << "Invalid number of threads: " << chunk.substr(chunk.find('=') + 1) << '\n';
+        return -8;
+      }
+    } else if (encoding &&
+        parse_option(chunk, "--streams=", 1u, max_streams, options.streams, valid)) {
+      if (!valid) {
+        usage(std::cerr) << "Invalid number of streams: " << chunk.substr(chunk.find('=') + 1) << '\n';
+        return -9;
+      }
+    } else if (encoding && chunk == "--index") {
+      options.index = true;
+    } else if (encoding && chunk == "--batch") {
+      options.batch = true;
+    } else if (encoding && parse_option(chunk, "--context=", 0u, 1u, options.context, valid)) {
+      if (!valid) {
+        usage(std::cerr) << "Invalid context: " << chunk.substr(chunk.find('=') + 1) << '\n';
+        return -12;
+      }
+    } else if (decoding && chunk.starts_with("--range=")) {
+      if (!parse_range(chunk.substr(chunk.find('=') + 1), options.range_offset, options.range_length)) {
+        usage(std::cerr) << "Invalid range: " << chunk.substr(chunk.find('=') + 1) << '\n';
+        return -10;
+      }
+    } else if ((encoding || decoding) && chunk.starts_with("--table=") && chunk.size() > 8) {
+      options.table = *arg + 8;
+    } else if ((encoding || decoding) && (chunk == "--stats" || chunk == "--stats=text")) {
+      options.stats = StatsFormat::text;
+    } else if ((encoding || decoding) && chunk == "--stats=json") {
+      options.stats = StatsFormat::json;
+    } else {
+      usage(std::cerr) << "Unknown option: " << chunk << '\n';
+      return -2;
     }
   }
 
+  if (options.table && (options.block_size != 0 || options.streams > 1 || options.index)) {
+    usage(std::cerr) << "--table cannot be combined with --block-size, --streams, or --index.\n";
+    return -11;
+  }
+  if (options.context != 0 && (options.table || options.streams > 1)) {
+    usage(std::cerr) << "--context cannot be combined with --table or --streams.\n";
+    return -13;
+  }
+
+  // "-" means standard input, as does no FILE at all.
   file = *arg;
-  if (!file && (command == "encode" || command == "compress")) {
-    usage(std::cerr) << command << " requires a FILE argument.\n";
-    return -4;
+  if (file && std::string_view(file) == "-") {
+    file = nullptr;
   }
 
   return 0;
@@ -721,23 +1639,47 @@ int main(int /*argc*/, char *argv[]) {
   bool help;
   std::string command;
   const char *file;
-  if (int rc = parse_command_line(argv, help, command, file)) {
+  Options options;
+  if (int rc = parse_command_line(argv, help, command, file, options)) {
     return rc;
   }
   if (help) {
     return 0;
   }
 
-  if (command == "encode" || command == "compress") {
-    return main_encode(file, std::cout);
-  }
-  if (command == "decode" || command == "decompress") {
-    return main_decode(file, std::cout);
+  // Write output through a large buffer directly to the standard output file
+  // descriptor, rather than through `std::cout`.
+  DescriptorBuf stdout_buf{STDOUT_FILENO};
+  std::ostream out{&stdout_buf};
+  Stopwatch watch;
+  Stats stats;
+  const bool encoding = command == "encode" || command == "compress";
+  int rc;
+  if (encoding && options.batch) {
+    rc = main_encode_batch(file, options, stats);
+  } else if (encoding) {
+    rc = main_encode(file, options, out, stats);
+  } else if (command == "decode" || command == "decompress") {
+    rc = main_decode(file, options, out, stats);
+  } else if (command == "graph") {
+    rc = main_graph(file, options, out);
+  } else if (command == "train") {
+    rc = main_train(file, options, out);
+  } else {
+    usage(std::cerr) << "Unknown command: " << command << '\n';
+    return -5;
   }
-  if (command == "graph") {
-    return main_graph(file, std::cout);
+
+  const bool flushed = bool(out.flush());
+  if (options.stats != StatsFormat::none) {
+    stats.output_bytes += stdout_buf.bytes_written();
+    print_stats(std::cerr, options.stats, command, encoding, watch.lap(), stats);
   }
 
-  usage(std::cerr) << "Unknown command: " << command << '\n';
-  return -5;
+  // If everything else succeeded but the output couldn't be written, then
+  // fail with a code distinct from those of the commands.
+  if (!flushed && rc == 0) {
+    return 11;
+  }
+  return rc;
 }
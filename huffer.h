@@ -0,0 +1,3021 @@
+#include "input_bit_stream.h"
+#include "output_bit_stream.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <bitset>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// This is the core of huffer: counting symbols, building codes, and encoding
+// and decoding them, without any of the command line. `huffer::Encoder` and
+// `huffer::Decoder`, at the end of this file, compress and decompress buffers
+// in memory.
+
+// `HUFFER_KERNEL` marks a function containing a hot loop, so that it is
+// compiled once for each of several levels of the x86-64 instruction set (the
+// baseline; AVX2 and BMI2; and AVX-512), and the best version that the
+// processor supports is chosen when the program is loaded. Elsewhere, it has
+// no effect.
+// The choice is made by resolvers that run before the sanitizers' runtimes
+// are initialized, so sanitized builds have one version of each kernel. To
+// have one version otherwise, define `HUFFER_KERNEL` to be empty.
+#ifndef HUFFER_KERNEL
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__has_attribute) && \
+    !defined(__SANITIZE_THREAD__) && !defined(__SANITIZE_ADDRESS__)
+#if __has_attribute(target_clones)
+#define HUFFER_KERNEL __attribute__((target_clones("default", "arch=x86-64-v3", "arch=x86-64-v4")))
+#endif
+#endif
+#endif
+#ifndef HUFFER_KERNEL
+#define HUFFER_KERNEL
+#endif
+
+namespace huffer {
+
+// `max_symbol_size` is the size, in bytes, of the largest input symbol. The
+// symbol size is at least one byte and at most `max_symbol_size` bytes. When
+// encoding, it is chosen by the caller. When decoding, it is read from the
+// file header.
+constexpr std::size_t max_symbol_size = 8;
+
+// `Symbol` is a fixed size chunk of the uncompressed input.
+// Huffman coding works by choosing shorter code words for more frequent
+// symbols, and longer code words for less frequent symbols.
+// A `Symbol` doesn't know its size. Its bytes beyond the symbol size are zero,
+// so that symbols of the same size compare as though only their meaningful
+// bytes were compared.
+class Symbol {
+  std::array<char, max_symbol_size> storage = {};
+public:
+  const char *data() const { return storage.data(); }
+  char *data() { return storage.data(); }
+  char& operator[](std::size_t i) { return storage[i]; }
+  char operator[](std::size_t i) const { return storage[i]; }
+};
+
+inline
+bool operator==(const Symbol& left, const Symbol& right) {
+  return std::equal(left.data(), left.data() + sizeof left, right.data());
+}
+
+// Symbols are ordered lexicographically by their unsigned bytes. This is the
+// order used for symbols of the same code word length in canonical codes.
+inline
+bool operator<(const Symbol& left, const Symbol& right) {
+  return std::lexicographical_compare(
+    left.data(), left.data() + sizeof left, right.data(), right.data() + sizeof right,
+    [](char a, char b) { return std::uint8_t(a) < std::uint8_t(b); });
+}
+
+// `SymbolSize<size>` is a symbol size that is known at compile time. Kernels
+// that take one, rather than a `std::size_t`, load, store, and step over
+// symbols of a fixed width, and so their loops can be unrolled and their
+// symbols moved as integers. See `with_symbol_size`.
+template <std::size_t size>
+using SymbolSize = std::integral_constant<std::size_t, size>;
+
+// Invoke the specified `function` with the `SymbolSize` that is the specified
+// `symbol_size`, and return its result. This is done once per kernel, so that
+// the kernel's loop is compiled for each symbol size. The behavior is
+// undefined unless `1 <= symbol_size && symbol_size <= max_symbol_size`.
+template <typename Function>
+decltype(auto) with_symbol_size(std::size_t symbol_size, Function&& function) {
+  static_assert(max_symbol_size == 8);
+  switch (symbol_size) {
+  case 1: return function(SymbolSize<1>{});
+  case 2: return function(SymbolSize<2>{});
+  case 3: return function(SymbolSize<3>{});
+  case 4: return function(SymbolSize<4>{});
+  case 5: return function(SymbolSize<5>{});
+  case 6: return function(SymbolSize<6>{});
+  case 7: return function(SymbolSize<7>{});
+  default: return function(SymbolSize<8>{});
+  }
+}
+
+// `CodeWord` is a code word packed into an integer, in the order in which its
+// bits are written: the first bit is the least significant.
+struct CodeWord {
+  std::uint64_t bits;
+  int length;
+};
+
+struct SymbolInfo {
+  // `frequency` is how often the symbol appears in the decoded file.
+  // It's used during encoding and graphing.
+  std::uint64_t frequency = 0;
+  // `code_word` is the encoded version of the symbol.
+  // It's used during encoding.
+  CodeWord code_word = {};
+};
+
+// `SymbolTable` maps symbols to `SymbolInfo`. It is an open addressing hash
+// table with linear probing, keyed by the bytes of the symbol packed into an
+// integer. Its entries are stored inline, so a lookup typically touches one
+// cache line and no entry is separately allocated.
+// A slot whose frequency is zero is empty, so symbols are added only with a
+// positive frequency.
+class SymbolTable {
+public:
+  // `Entry` is an occupied slot. `symbol`'s bytes beyond the symbol size are
+  // zero, so that `symbol` can be compared as a single integer.
+  struct Entry {
+    Symbol symbol;
+    SymbolInfo info;
+  };
+
+private:
+  std::vector<Entry> slots;
+  std::size_t count;
+  // `shift` is 64 minus the base two logarithm of the number of slots; see
+  // `slot_of`.
+  int shift;
+  std::size_t width;
+
+public:
+  class const_iterator;
+
+  // Create an empty table of symbols having the specified `symbol_size`.
+  explicit SymbolTable(std::size_t symbol_size);
+
+  // Return the `symbol_size()` bytes at the specified `data`, packed into an
+  // integer. The overload taking a `SymbolSize` copies a fixed number of
+  // bytes; its behavior is undefined unless `size` is `symbol_size()`.
+  std::uint64_t key(const char *data) const;
+  template <std::size_t size>
+  static std::uint64_t key(const char *data, SymbolSize<size>) {
+    std::uint64_t result = 0;
+    std::memcpy(&result, data, size);
+    return result;
+  }
+
+  std::size_t size() const { return count; }
+  std::size_t symbol_size() const { return width; }
+
+  // Remove all of the symbols, but keep the slots for reuse.
+  void clear();
+
+  // Add the specified `frequency` to that of the symbol whose key is the
+  // specified `key`, inserting the symbol if necessary. The behavior is
+  // undefined unless `frequency` is positive.
+  void add(std::uint64_t key, std::uint64_t frequency);
+  void add(const Symbol& symbol, std::uint64_t frequency) {
+    add(key(Entry{.symbol = symbol, .info = {}}), frequency);
+  }
+
+  // Return the information about the symbol having the specified `key`, or
+  // null if there is no such symbol.
+  SymbolInfo *find(std::uint64_t key);
+  const SymbolInfo *find(std::uint64_t key) const {
+    return const_cast<SymbolTable*>(this)->find(key);
+  }
+  SymbolInfo *find(const Symbol& symbol) { return find(key(Entry{.symbol = symbol, .info = {}})); }
+  const SymbolInfo *find(const Symbol& symbol) const { return find(key(Entry{.symbol = symbol, .info = {}})); }
+
+  // Iterate over the entries in no particular order.
+  const_iterator begin() const;
+  const_iterator end() const;
+
+private:
+  // Return the index of the first slot to probe for the specified `key`.
+  // Multiplying by 2^64 divided by the golden ratio mixes the bits of `key`
+  // into the high order bits of the product (Fibonacci hashing).
+  std::size_t slot_of(std::uint64_t key) const {
+    return (key * 0x9E3779B97F4A7C15ull) >> shift;
+  }
+
+  static std::uint64_t key(const Entry& entry) {
+    std::uint64_t result;
+    std::memcpy(&result, entry.symbol.data(), sizeof result);
+    return result;
+  }
+
+  // Double the number of slots.
+  void grow();
+};
+
+class SymbolTable::const_iterator {
+  const Entry *current;
+  const Entry *last;
+
+  void skip_empty() {
+    while (current != last && current->info.frequency == 0) {
+      ++current;
+    }
+  }
+
+public:
+  const_iterator(const Entry *current, const Entry *last)
+  : current(current), last(last) {
+    skip_empty();
+  }
+
+  const Entry& operator*() const { return *current; }
+  const Entry *operator->() const { return current; }
+  const_iterator& operator++() {
+    ++current;
+    skip_empty();
+    return *this;
+  }
+  bool operator==(const const_iterator& other) const { return current == other.current; }
+};
+
+inline
+SymbolTable::SymbolTable(std::size_t symbol_size)
+: slots(16)
+, count(0)
+, shift(64 - 4)
+, width(symbol_size) {
+}
+
+inline
+std::uint64_t SymbolTable::key(const char *data) const {
+  std::uint64_t result = 0;
+  std::memcpy(&result, data, width);
+  return result;
+}
+
+inline
+void SymbolTable::clear() {
+  std::fill(slots.begin(), slots.end(), Entry{});
+  count = 0;
+}
+
+inline
+void SymbolTable::add(std::uint64_t key, std::uint64_t frequency) {
+  const std::size_t mask = slots.size() - 1;
+  for (std::size_t i = slot_of(key);; i = (i + 1) & mask) {
+    Entry& entry = slots[i];
+    if (entry.info.frequency == 0) {
+      break;
+    }
+    if (SymbolTable::key(entry) == key) {
+      entry.info.frequency += frequency;
+      return;
+    }
+  }
+
+  // It's a new symbol. Keep the table at most half full.
+  if (2 * (count + 1) > slots.size()) {
+    grow();
+  }
+  std::size_t i = slot_of(key);
+  while (slots[i].info.frequency != 0) {
+    i = (i + 1) & (slots.size() - 1);
+  }
+  std::memcpy(slots[i].symbol.data(), &key, sizeof key);
+  slots[i].info = SymbolInfo{.frequency = frequency};
+  ++count;
+}
+
+inline
+SymbolInfo *SymbolTable::find(std::uint64_t key) {
+  const std::size_t mask = slots.size() - 1;
+  for (std::size_t i = slot_of(key);; i = (i + 1) & mask) {
+    Entry& entry = slots[i];
+    if (entry.info.frequency == 0) {
+      return nullptr;
+    }
+    if (SymbolTable::key(entry) == key) {
+      return &entry.info;
+    }
+  }
+}
+
+inline
+void SymbolTable::grow() {
+  std::vector<Entry> old(slots.size() * 2);
+  std::swap(old, slots);
+  --shift;
+  const std::size_t mask = slots.size() - 1;
+  for (const Entry& entry : old) {
+    if (entry.info.frequency == 0) {
+      continue;
+    }
+    std::size_t i = slot_of(key(entry));
+    while (slots[i].info.frequency != 0) {
+      i = (i + 1) & mask;
+    }
+    slots[i] = entry;
+  }
+}
+
+inline
+SymbolTable::const_iterator SymbolTable::begin() const {
+  return const_iterator(slots.data(), slots.data() + slots.size());
+}
+
+inline
+SymbolTable::const_iterator SymbolTable::end() const {
+  return const_iterator(slots.data() + slots.size(), slots.data() + slots.size());
+}
+
+struct Symbols {
+  // `info` maps each input symbol to information needed for encoding or
+  // graphing.
+  SymbolTable info;
+  // `extra` is any trailing (unencoded) data. If the unencoded file's size is
+  // not a multiple of the symbol size, then `extra` will contain the
+  // remainder.
+  // It's used during graphing.
+  std::string extra;
+  // `total_size` is the length, in bytes, of the entire input.
+  std::uint64_t total_size = 0;
+  // `histograms` are scratch space for counting symbols (see
+  // `count_symbols`), kept so that counting again doesn't reallocate them.
+  std::vector<std::vector<std::uint64_t>> histograms;
+
+  explicit Symbols(std::size_t symbol_size)
+  : info(symbol_size) {
+  }
+
+  std::size_t symbol_size() const { return info.symbol_size(); }
+
+  // Forget the counted symbols, but keep the storage for reuse.
+  void clear() {
+    info.clear();
+    extra.clear();
+    total_size = 0;
+  }
+};
+
+struct Node {
+  // `weight` is the sum of all symbol frequencies in the subtree rooted at
+  // this node.
+  // It's used during encoding and graphing.
+  std::uint64_t weight;
+  // `type`, `leaf`, and `internal` form a discriminated union.
+  // A `Node` is either a leaf node or an internal node.
+  // A leaf node is just a `Symbol`.
+  // An internal node contains the indices (see `Tree`) of its left and right
+  // subtrees.
+  // The `left` subtree corresponds to a 0 bit in the code word, while
+  // the `right` subtree corresponds to a 1 bit in the code word.
+  // An internal node also contains an integer ID, which is used during
+  // graphing.
+  enum class Type : bool {
+    leaf,
+    internal
+  } type;
+  union {
+    Symbol leaf;
+    struct {
+      std::uint32_t id;
+      std::uint32_t left;
+      std::uint32_t right;
+    } internal;
+  };
+};
+
+// `Tree` is a tree of `Node`s stored contiguously, so that building and
+// destroying a tree allocates and frees only one array, and walking it stays
+// within that array. A node refers to its children by their indices in
+// `nodes`. A `Tree` having no nodes is empty.
+struct Tree {
+  std::vector<Node> nodes;
+  std::uint32_t root_index = 0;
+
+  bool empty() const { return nodes.empty(); }
+  // The behavior of these is undefined if the tree is empty, or if the
+  // specified `node` is not an internal node of this tree.
+  const Node& root() const { return nodes[root_index]; }
+  const Node& left(const Node& node) const { return nodes[node.internal.left]; }
+  const Node& right(const Node& node) const { return nodes[node.internal.right]; }
+};
+
+// `min_bytes_per_thread` is the least amount of input worth counting on a
+// separate thread.
+constexpr std::size_t min_bytes_per_thread = 1 << 20;
+
+// Return whether symbols of the specified `symbol_size` are small enough, at
+// one or two bytes, to be used directly as indices into flat arrays, rather
+// than looked up in a hash table.
+constexpr
+bool dense_symbols(std::size_t symbol_size) {
+  return symbol_size <= 2;
+}
+
+// Return the number of distinct symbols of the specified `symbol_size` when
+// `dense_symbols(symbol_size)`.
+inline
+std::size_t dense_symbol_count(std::size_t symbol_size) {
+  return std::size_t(1) << (8 * symbol_size);
+}
+
+// Return the flat array index of the dense symbol of the specified
+// `symbol_size` whose bytes begin at the specified `data`.
+inline
+std::size_t dense_index(const char *data, std::size_t symbol_size) {
+  std::size_t index = std::uint8_t(data[0]);
+  if (symbol_size == 2) {
+    index |= std::size_t(std::uint8_t(data[1])) << 8;
+  }
+  return index;
+}
+
+// Return the dense symbol whose flat array index is the specified `index`.
+inline
+Symbol dense_symbol(std::size_t index) {
+  Symbol symbol;
+  symbol[0] = char(index & 0xff);
+  symbol[1] = char(index >> 8);
+  return symbol;
+}
+
+// Add to the specified `histogram` and `odd`, which are indexed by
+// `dense_index`, the frequency of each symbol of the specified `symbol_size`
+// in the specified `size` bytes at the specified `data`, such that the
+// frequency of a symbol is its sum over the two. The behavior is undefined
+// unless `dense_symbols(symbol_size)` and `size` is a multiple of
+// `symbol_size`.
+// Runs of the same symbol would make each increment wait on the previous one,
+// so consecutive symbols are counted in separate sub-histograms. Two byte
+// symbols alternate between `histogram` and `odd`, which the caller keeps so
+// that they aren't allocated for each call.
+HUFFER_KERNEL
+inline
+void count_dense_symbols(const char *data, std::size_t size, std::size_t symbol_size, std::vector<std::uint64_t>& histogram, std::vector<std::uint64_t>& odd) {
+  const auto byte = [data](std::size_t i) { return std::size_t(std::uint8_t(data[i])); };
+  if (symbol_size == 1) {
+    std::uint64_t counts[4][256] = {};
+    std::size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+      ++counts[0][byte(i)];
+      ++counts[1][byte(i + 1)];
+      ++counts[2][byte(i + 2)];
+      ++counts[3][byte(i + 3)];
+    }
+    for (; i < size; ++i) {
+      ++counts[0][byte(i)];
+    }
+    for (std::size_t j = 0; j < 256; ++j) {
+      histogram[j] += counts[0][j] + counts[1][j] + counts[2][j] + counts[3][j];
+    }
+    return;
+  }
+
+  std::size_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    ++histogram[byte(i) | byte(i + 1) << 8];
+    ++odd[byte(i + 2) | byte(i + 3) << 8];
+  }
+  if (i < size) {
+    ++histogram[byte(i) | byte(i + 1) << 8];
+  }
+}
+
+// Add to the specified `symbols` the frequency of each symbol in the
+// specified `size` bytes at the specified `data`, using up to the specified
+// `threads` threads. The behavior is undefined unless `size` is a multiple of
+// the symbol size.
+// With more than one thread, the input is divided into ranges, each a whole
+// number of symbols, that are counted into separate tables and then merged.
+inline
+void count_symbols(const char *data, std::size_t size, unsigned threads, Symbols& symbols) {
+  const std::size_t symbol_size = symbols.symbol_size();
+  assert(size % symbol_size == 0);
+  const std::size_t symbol_count = size / symbol_size;
+  const std::size_t ranges = std::min<std::size_t>(
+    std::max(threads, 1u), std::max<std::size_t>(size / min_bytes_per_thread, 1));
+  const auto range_begin = [=](std::size_t i) {
+    return symbol_count * i / ranges * symbol_size;
+  };
+  const auto for_each_range = [&](const auto& count_range) {
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < ranges; ++i) {
+      workers.emplace_back(count_range, i, range_begin(i), range_begin(i + 1));
+    }
+    count_range(0, range_begin(0), range_begin(1));
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  };
+
+  if (dense_symbols(symbol_size)) {
+    std::vector<std::vector<std::uint64_t>>& histograms = symbols.histograms;
+    histograms.resize(2 * ranges);
+    for (std::vector<std::uint64_t>& histogram : histograms) {
+      histogram.assign(dense_symbol_count(symbol_size), 0);
+    }
+    for_each_range([&](std::size_t i, std::size_t begin, std::size_t end) {
+      count_dense_symbols(data + begin, end - begin, symbol_size, histograms[2 * i], histograms[2 * i + 1]);
+    });
+    for (std::size_t index = 0; index < dense_symbol_count(symbol_size); ++index) {
+      std::uint64_t frequency = 0;
+      for (const std::vector<std::uint64_t>& histogram : histograms) {
+        frequency += histogram[index];
+      }
+      if (frequency != 0) {
+        symbols.info.add(dense_symbol(index), frequency);
+      }
+    }
+    return;
+  }
+
+  const auto count_range = [=](std::size_t begin, std::size_t end, Symbols& into) {
+    with_symbol_size(symbol_size, [&](auto width) {
+      for (std::size_t i = begin; i < end; i += width) {
+        into.info.add(into.info.key(data + i, width), 1);
+      }
+    });
+  };
+  if (ranges == 1) {
+    count_range(0, size, symbols);
+    return;
+  }
+  std::vector<Symbols> partial(ranges, Symbols{symbol_size});
+  for_each_range([&](std::size_t i, std::size_t begin, std::size_t end) {
+    count_range(begin, end, partial[i]);
+  });
+  for (const Symbols& counted : partial) {
+    for (const auto& [symbol, info] : counted.info) {
+      symbols.info.add(symbol, info.frequency);
+    }
+  }
+}
+
+// Count the symbols of the specified `symbol_size` in the specified `in`,
+// using up to the specified `threads` threads. The input is read in chunks
+// that are a whole number of symbols, so that no symbol straddles two chunks.
+// The chunks are of a fixed size, whatever the number of threads, and
+// `count_symbols` divides each chunk among the threads.
+inline
+Symbols read_symbols(std::istream& in, std::size_t symbol_size, unsigned threads) {
+  Symbols symbols{symbol_size};
+
+  const std::size_t chunk_size = (16 * min_bytes_per_thread / symbol_size) * symbol_size;
+  std::vector<char> chunk(chunk_size);
+  for (;;) {
+    in.read(chunk.data(), chunk.size());
+    const std::size_t count = in.gcount();
+    symbols.total_size += count;
+    const std::size_t whole = count - count % symbol_size;
+    count_symbols(chunk.data(), whole, threads, symbols);
+    if (count < chunk.size()) {
+      symbols.extra.assign(chunk.data() + whole, count - whole);
+      break;
+    }
+  }
+
+  return symbols;
+}
+
+// Replace the contents of the specified `symbols` with the symbols of the
+// specified `size` bytes at the specified `data`, counted using up to the
+// specified `threads` threads.
+inline
+void read_symbols(const char *data, std::size_t size, unsigned threads, Symbols& symbols) {
+  symbols.clear();
+  symbols.total_size = size;
+
+  const std::size_t whole = size - size % symbols.symbol_size();
+  count_symbols(data, whole, threads, symbols);
+  symbols.extra.assign(data + whole, size - whole);
+}
+
+// Count the symbols of the specified `symbol_size` in the specified `size`
+// bytes at the specified `data`, using up to the specified `threads` threads.
+inline
+Symbols read_symbols(const char *data, std::size_t size, std::size_t symbol_size, unsigned threads) {
+  Symbols symbols{symbol_size};
+  read_symbols(data, size, threads, symbols);
+  return symbols;
+}
+
+// `Leaf` is a symbol and its frequency.
+struct Leaf {
+  Symbol symbol;
+  std::uint64_t frequency;
+};
+
+// Return a `Leaf` for each of the specified `symbols`, sorted by ascending
+// frequency, and then by symbol so that the order doesn't depend on the
+// iteration order of `symbols.info`, which varies with how the symbols were
+// counted.
+// This is a least significant digit first radix sort whose digits are the
+// bytes of the symbol, last to first, followed by the bytes of the frequency.
+// A pass in which every leaf has the same digit is skipped, so most of the
+// frequency's high order bytes cost one counting scan each.
+inline
+std::vector<Leaf> sorted_leaves(const Symbols& symbols) {
+  std::vector<Leaf> leaves;
+  leaves.reserve(symbols.info.size());
+  for (const auto& [symbol, info] : symbols.info) {
+    leaves.push_back({.symbol = symbol, .frequency = info.frequency});
+  }
+
+  const std::size_t symbol_size = symbols.symbol_size();
+  const int digits = symbol_size + sizeof(std::uint64_t);
+  const auto digit = [=](const Leaf& leaf, int which) -> std::uint8_t {
+    if (which < int(symbol_size)) {
+      return leaf.symbol[symbol_size - 1 - which];
+    }
+    return leaf.frequency >> (8 * (which - symbol_size));
+  };
+  std::vector<Leaf> sorted(leaves.size());
+  for (int which = 0; which < digits; ++which) {
+    std::array<std::size_t, 256> offsets = {};
+    for (const Leaf& leaf : leaves) {
+      ++offsets[digit(leaf, which)];
+    }
+    if (std::find(offsets.begin(), offsets.end(), leaves.size()) != offsets.end()) {
+      continue;
+    }
+    std::size_t offset = 0;
+    for (std::size_t& count : offsets) {
+      offset += std::exchange(count, offset);
+    }
+    for (const Leaf& leaf : leaves) {
+      sorted[offsets[digit(leaf, which)]++] = leaf;
+    }
+    std::swap(leaves, sorted);
+  }
+  return leaves;
+}
+
+inline
+Tree build_tree(const Symbols& symbols) {
+  Tree tree;
+  const std::vector<Leaf> leaves = sorted_leaves(symbols);
+  if (leaves.empty()) {
+    return tree;
+  }
+  const std::uint32_t leaf_count = leaves.size();
+  std::vector<Node>& nodes = tree.nodes;
+  nodes.reserve(2 * leaf_count - 1);
+
+  // First the leaves.
+  for (const Leaf& leaf : leaves) {
+    nodes.push_back(Node{
+      .weight = leaf.frequency,
+      .type = Node::Type::leaf,
+      .leaf = leaf.symbol
+    });
+  }
+
+  // Build up the tree's internal nodes greedily, always taking the two lowest
+  // weighted nodes to create a new node. The leaves are sorted by weight, and
+  // each new internal node weighs no less than the one before it, so the
+  // lowest weighted node is always either the first leaf not yet taken or the
+  // first internal node not yet taken (the "two-queue" method). Ties go to
+  // the leaf.
+  std::uint32_t next_leaf = 0;
+  std::uint32_t next_internal = leaf_count;
+  const auto take = [&]() {
+    if (next_leaf < leaf_count &&
+        (next_internal == nodes.size() || nodes[next_leaf].weight <= nodes[next_internal].weight)) {
+      return next_leaf++;
+    }
+    return next_internal++;
+  };
+  std::uint32_t next_node_id = 1;
+  while (nodes.size() < 2 * std::size_t(leaf_count) - 1) {
+    const std::uint32_t left = take();
+    const std::uint32_t right = take();
+    nodes.push_back(Node{
+      .weight = nodes[left].weight + nodes[right].weight,
+      .type = Node::Type::internal,
+      .internal = {
+        .id = next_node_id++,
+        .left = left,
+        .right = right
+      }
+    });
+  }
+
+  tree.root_index = nodes.size() - 1;
+  return tree;
+}
+
+// `longest_code_length` is the length, in bits, of the longest code word that
+// the format allows. Canonical code words are computed using 64-bit
+// arithmetic.
+constexpr int longest_code_length = 64;
+
+// `CodeLength` is a symbol and the length, in bits, of its code word.
+// A sequence of `CodeLength` sorted in canonical order (see `sort_canonical`)
+// is all that is needed to assign code words to the symbols (see
+// `for_each_code_word`).
+struct CodeLength {
+  Symbol symbol;
+  int length;
+};
+
+// Replace each of the specified `weights`, which must be sorted in ascending
+// order, with the length of its code word in a Huffman code, so that the
+// lengths are in descending order. The behavior is undefined unless there are
+// at least two weights.
+// This is the in-place algorithm of Moffat and Katajainen. The first pass
+// builds the tree as in the two-queue method, storing each internal node's
+// weight and then its parent's index where the leaves were. The second pass
+// turns the parent indices into depths. The third pass assigns leaf depths
+// from the number of internal nodes at each depth.
+inline
+void minimum_redundancy(std::vector<std::uint64_t>& weights) {
+  std::vector<std::uint64_t>& a = weights;
+  const std::size_t n = a.size();
+  assert(n >= 2);
+
+  a[0] += a[1];
+  std::size_t root = 0;
+  std::size_t leaf = 2;
+  for (std::size_t next = 1; next < n - 1; ++next) {
+    // Select the first node of the pair.
+    if (leaf >= n || a[root] < a[leaf]) {
+      a[next] = a[root];
+      a[root++] = next;
+    } else {
+      a[next] = a[leaf++];
+    }
+    // Add on the second.
+    if (leaf >= n || (root < next && a[root] < a[leaf])) {
+      a[next] += a[root];
+      a[root++] = next;
+    } else {
+      a[next] += a[leaf++];
+    }
+  }
+
+  a[n - 2] = 0;
+  for (std::size_t next = n - 2; next-- > 0;) {
+    a[next] = a[a[next]] + 1;
+  }
+
+  std::uint64_t available = 1;
+  std::uint64_t used = 0;
+  std::uint64_t depth = 0;
+  std::ptrdiff_t internal = n - 2;
+  std::size_t next = n;
+  while (available > 0) {
+    while (internal >= 0 && a[internal] == depth) {
+      ++used;
+      --internal;
+    }
+    while (available > used) {
+      a[--next] = depth;
+      --available;
+    }
+    available = 2 * used;
+    ++depth;
+    used = 0;
+  }
+}
+
+// Return the code word length for each of the specified `frequencies`, which
+// must be sorted in ascending order, such that no code word is longer than the
+// specified `max_length` and the total encoded length is minimal. The behavior
+// is undefined unless there are at least two frequencies and no more than
+// `2^max_length` of them.
+// This is the package-merge algorithm of Larmore and Hirschberg. Think of each
+// frequency as a coin that is available in each of the denominations 2^-1
+// through 2^-max_length. Starting from the smallest denomination, adjacent
+// pairs of coins are "packaged" into a coin of the next larger denomination
+// and merged, by weight, with the original coins of that denomination. A
+// solution is the lightest 2n - 2 coins of denomination 2^-1, and a symbol's
+// code word length is the number of its coins included in the solution.
+inline
+std::vector<int> package_merge(const std::vector<std::uint64_t>& frequencies, int max_length) {
+  const std::size_t n = frequencies.size();
+  assert(n >= 2);
+  assert(max_length >= longest_code_length || n <= std::size_t(1) << max_length);
+
+  // `is_package[depth - 1]` records, for each coin of denomination 2^-depth in
+  // order of weight, whether the coin is a package rather than an original.
+  // Only the weights of the current denomination are kept.
+  std::vector<std::vector<bool>> is_package(max_length);
+  is_package[max_length - 1].assign(n, false);
+  std::vector<std::uint64_t> smaller = frequencies;
+  std::vector<std::uint64_t> coins;
+  for (int depth = max_length - 1; depth >= 1; --depth) {
+    std::vector<bool>& packages = is_package[depth - 1];
+    coins.clear();
+    std::size_t leaf = 0;
+    std::size_t pair = 0;
+    while (leaf < n || pair + 1 < smaller.size()) {
+      if (pair + 1 < smaller.size() &&
+          (leaf == n || smaller[pair] + smaller[pair + 1] < frequencies[leaf])) {
+        coins.push_back(smaller[pair] + smaller[pair + 1]);
+        packages.push_back(true);
+        pair += 2;
+      } else {
+        coins.push_back(frequencies[leaf++]);
+        packages.push_back(false);
+      }
+    }
+    std::swap(smaller, coins);
+  }
+
+  // Walk back down the denominations. The originals chosen from each
+  // denomination are always the lightest, and each chosen package accounts for
+  // two chosen coins of the next smaller denomination.
+  std::vector<int> lengths(n, 0);
+  std::size_t chosen = 2 * n - 2;
+  for (int depth = 1; depth <= max_length && chosen; ++depth) {
+    const std::vector<bool>& packages = is_package[depth - 1];
+    std::size_t package_count = 0;
+    std::size_t original_count = 0;
+    for (std::size_t i = 0; i < chosen; ++i) {
+      if (packages[i]) {
+        ++package_count;
+      } else {
+        ++lengths[original_count++];
+      }
+    }
+    chosen = 2 * package_count;
+  }
+  return lengths;
+}
+
+// Return code word lengths for the specified `symbols`, none of which exceeds
+// the specified `max_length`. The behavior is undefined unless
+// `1 <= max_length && max_length <= longest_code_length` and there are no more
+// than `2^max_length` symbols.
+inline
+std::vector<CodeLength> build_code_lengths(const Symbols& symbols, int max_length) {
+  const std::vector<Leaf> leaves = sorted_leaves(symbols);
+  std::vector<CodeLength> lengths;
+  if (leaves.empty()) {
+    return lengths;
+  }
+  // Corner case: If there's only one symbol, then it codes to "0".
+  if (leaves.size() == 1) {
+    lengths.push_back({.symbol = leaves[0].symbol, .length = 1});
+    return lengths;
+  }
+
+  std::vector<std::uint64_t> frequencies;
+  frequencies.reserve(leaves.size());
+  for (const Leaf& leaf : leaves) {
+    frequencies.push_back(leaf.frequency);
+  }
+
+  // Huffman's algorithm is optimal if it happens to respect the limit. The
+  // longest code word is that of the least frequent symbol.
+  std::vector<std::uint64_t> huffman = frequencies;
+  minimum_redundancy(huffman);
+  lengths.reserve(leaves.size());
+  if (huffman[0] <= std::uint64_t(max_length)) {
+    for (std::size_t i = 0; i < leaves.size(); ++i) {
+      lengths.push_back({.symbol = leaves[i].symbol, .length = int(huffman[i])});
+    }
+    return lengths;
+  }
+
+  const std::vector<int> limited = package_merge(frequencies, max_length);
+  for (std::size_t i = 0; i < leaves.size(); ++i) {
+    lengths.push_back({.symbol = leaves[i].symbol, .length = limited[i]});
+  }
+  return lengths;
+}
+
+// Return whether the specified `symbols` can be given code words no longer
+// than the specified `max_code_length`.
+inline
+bool can_encode(const Symbols& symbols, int max_code_length) {
+  return max_code_length >= longest_code_length ||
+         symbols.info.size() <= std::size_t(1) << max_code_length;
+}
+
+// `symbol_size_sample_size` is about the most bytes of input that
+// `choose_symbol_size` examines.
+constexpr std::size_t symbol_size_sample_size = 1 << 20;
+
+// Return the symbol size, from 1 through `max_symbol_size`, with which the
+// specified `size` bytes at the specified `data` are estimated to encode the
+// smallest, code lengths included, using code words no longer than the
+// specified `max_code_length`. If `size` is more than
+// `symbol_size_sample_size`, then the estimates are made from evenly spaced
+// chunks of the input, and the number of distinct symbols in the whole input
+// is extrapolated from the number that occur once in the chunks. Ties go to
+// the smaller symbol size. At most `symbol_size_sample_size` bytes are
+// counted for each symbol size, so the time taken is bounded, and symbol
+// sizes larger than one at which most sampled symbols are unique are not
+// tried.
+inline
+std::size_t choose_symbol_size(const char *data, std::size_t size, int max_code_length) {
+  // The chunks begin and end at multiples of every symbol size, so that each
+  // symbol size sees the same symbols in a chunk as in the whole input.
+  constexpr std::size_t alignment = 840; // lcm(1, 2, ..., 8)
+  constexpr std::size_t chunk_size = 16 * alignment;
+  std::vector<char> chunks;
+  const char *sample = data;
+  std::size_t sample_size = size;
+  if (size > symbol_size_sample_size) {
+    const std::size_t chunk_count = symbol_size_sample_size / chunk_size;
+    const std::size_t stride = size / chunk_count / alignment * alignment;
+    for (std::size_t i = 0; i < chunk_count; ++i) {
+      chunks.insert(chunks.end(), data + i * stride, data + i * stride + chunk_size);
+    }
+    sample = chunks.data();
+    sample_size = chunks.size();
+  }
+  const double scale = double(size) / sample_size;
+
+  std::size_t best = 1;
+  double best_bits = std::numeric_limits<double>::infinity();
+  for (std::size_t symbol_size = 1; symbol_size <= max_symbol_size; ++symbol_size) {
+    const Symbols symbols = read_symbols(sample, sample_size, symbol_size, 1);
+    if (!can_encode(symbols, max_code_length)) {
+      continue;
+    }
+    std::uint64_t singletons = 0;
+    for (const SymbolTable::Entry& entry : symbols.info) {
+      singletons += entry.info.frequency == 1;
+    }
+    const double possible = std::min(double(size / symbol_size), std::pow(256.0, double(symbol_size)));
+    const double distinct = std::min(possible, symbols.info.size() + singletons * (scale - 1));
+    if (max_code_length < longest_code_length && distinct > std::ldexp(1.0, max_code_length)) {
+      continue;
+    }
+    double code_bits = 0;
+    for (const CodeLength& entry : build_code_lengths(symbols, max_code_length)) {
+      code_bits += double(symbols.info.find(entry.symbol)->frequency) * entry.length;
+    }
+    if (scale > 1) {
+      // A code fits the sample it's built from better than it fits the rest
+      // of the input. Correct for that as for the entropy of a sample
+      // (Miller-Madow), so that large alphabets aren't favored.
+      code_bits += (symbols.info.size() - 1) / (2 * std::log(2.0));
+    }
+    // Each distinct symbol is written into the code lengths, and the "extra"
+    // is written verbatim.
+    const double bits = code_bits * scale + distinct * 8 * symbol_size + (size % symbol_size) * 8;
+    if (bits < best_bits) {
+      best = symbol_size;
+      best_bits = bits;
+    }
+    // Once most of the sampled symbols occur only once, the code lengths
+    // cost about as much as the input itself, and larger symbols would only
+    // be more unique, so they aren't worth counting.
+    if (2 * singletons > sample_size / symbol_size) {
+      break;
+    }
+  }
+  return best;
+}
+
+// Sort the specified `lengths` into canonical order: shorter code words
+// first, and then by symbol.
+inline
+void sort_canonical(std::vector<CodeLength>& lengths) {
+  std::sort(lengths.begin(), lengths.end(), [](const CodeLength& left, const CodeLength& right) {
+    if (left.length != right.length) {
+      return left.length < right.length;
+    }
+    return left.symbol < right.symbol;
+  });
+}
+
+// Return the specified `value` with the order of its bits reversed.
+inline
+std::uint64_t reverse_bits(std::uint64_t value) {
+  value = ((value >> 1) & 0x5555555555555555ull) | ((value & 0x5555555555555555ull) << 1);
+  value = ((value >> 2) & 0x3333333333333333ull) | ((value & 0x3333333333333333ull) << 2);
+  value = ((value >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((value & 0x0F0F0F0F0F0F0F0Full) << 4);
+  value = ((value >> 8) & 0x00FF00FF00FF00FFull) | ((value & 0x00FF00FF00FF00FFull) << 8);
+  value = ((value >> 16) & 0x0000FFFF0000FFFFull) | ((value & 0x0000FFFF0000FFFFull) << 16);
+  return (value >> 32) | (value << 32);
+}
+
+// Return the specified `code`, having the specified `length`, with the order
+// of its bits reversed. This gives the order in which the bits are read. The
+// behavior is undefined unless `1 <= length && length <= 64`.
+inline
+std::uint64_t reverse_bits(std::uint64_t code, int length) {
+  return reverse_bits(code) >> (64 - length);
+}
+
+// Invoke the specified `visit` as `visit(i, code_word)` for each index `i` of
+// the specified `lengths`, which must be in canonical order, where
+// `code_word` is the canonical code word of `lengths[i]`.
+// Each canonical code word is the previous code word plus one, extended with
+// zeros to its length, where the first bit is the most significant. Canonical
+// codes allow code words to be transmitted as only their lengths.
+template <typename Visit>
+void for_each_code_word(const std::vector<CodeLength>& lengths, Visit&& visit) {
+  std::uint64_t code = 0;
+  int previous_length = 0;
+  for (std::size_t i = 0; i < lengths.size(); ++i) {
+    const int length = lengths[i].length;
+    if (i != 0) {
+      ++code;
+    }
+    // The first code word can be 64 bits long, and shifting a 64-bit integer
+    // by 64 is undefined, so the shift is done in two steps.
+    const int shift = length - previous_length;
+    code = code << (shift / 2) << (shift - shift / 2);
+    previous_length = length;
+    visit(i, CodeWord{.bits = reverse_bits(code, length), .length = length});
+  }
+}
+
+// Assign to each of the specified `symbols` its canonical code word as
+// described by the specified `lengths`, which must be in canonical order.
+inline
+void build_code_words(Symbols& symbols, const std::vector<CodeLength>& lengths) {
+  for_each_code_word(lengths, [&](std::size_t i, CodeWord code_word) {
+    symbols.info.find(lengths[i].symbol)->code_word = code_word;
+  });
+}
+
+// `CodeBook` maps symbols to code words for encoding.
+// When `dense_symbols`, the code words are kept in a flat array indexed by
+// `dense_index`. Otherwise, they're kept in `Symbols::info`.
+class CodeBook {
+  Symbols *symbols;
+  std::vector<CodeWord> dense;
+  // `longest` is the length of the longest code word.
+  int longest;
+
+  // Write to the specified `out` the code word of each symbol of the
+  // specified `symbol_size` in the specified `size` bytes at the specified
+  // `data`, where the specified `code_word` returns the code word of the
+  // symbol at a given address. Code words are combined `batch` at a time into
+  // a single `put_bits`. The behavior is undefined unless
+  // `batch * longest <= 64`.
+  template <int batch, std::size_t symbol_size, typename CodeWordOf>
+  void encode_batches(OutputBitStream& out, const char *data, std::size_t size, SymbolSize<symbol_size>, CodeWordOf code_word);
+
+public:
+  // Create a code book having no code words. The behavior of `encode` is
+  // undefined until `assign` is called.
+  CodeBook();
+
+  // Assign code words to the specified `symbols` as described by the
+  // specified `lengths`, which must be in canonical order.
+  CodeBook(Symbols& symbols, const std::vector<CodeLength>& lengths);
+
+  // Replace the code words with those that the constructor would assign,
+  // reusing the storage of the previous code words.
+  void assign(Symbols& symbols, const std::vector<CodeLength>& lengths);
+
+  // Write to the specified `out` the code word of each symbol in the
+  // specified `size` bytes at the specified `data`. The behavior is undefined
+  // unless `size` is a multiple of the symbol size and each symbol has a code
+  // word.
+  void encode(OutputBitStream& out, const char *data, std::size_t size);
+
+  // Write to the specified `out` the code word of each symbol in the
+  // specified `size` bytes at the specified `data`, or, for a symbol that
+  // has no code word, the specified `escape` code word followed by the
+  // symbol itself. The behavior is undefined unless `size` is a multiple of
+  // the symbol size.
+  void encode(OutputBitStream& out, const char *data, std::size_t size, const CodeWord& escape);
+};
+
+inline
+CodeBook::CodeBook()
+: symbols(nullptr)
+, longest(0) {
+}
+
+inline
+CodeBook::CodeBook(Symbols& symbols, const std::vector<CodeLength>& lengths)
+: CodeBook() {
+  assign(symbols, lengths);
+}
+
+inline
+void CodeBook::assign(Symbols& symbols, const std::vector<CodeLength>& lengths) {
+  this->symbols = &symbols;
+  longest = 0;
+  for (const CodeLength& entry : lengths) {
+    longest = std::max(longest, entry.length);
+  }
+  const std::size_t symbol_size = symbols.symbol_size();
+  if (!dense_symbols(symbol_size)) {
+    dense.clear();
+    build_code_words(symbols, lengths);
+    return;
+  }
+
+  dense.assign(dense_symbol_count(symbol_size), CodeWord{});
+  for_each_code_word(lengths, [&](std::size_t i, CodeWord code_word) {
+    dense[dense_index(lengths[i].symbol.data(), symbol_size)] = code_word;
+  });
+}
+
+template <int batch, std::size_t symbol_size, typename CodeWordOf>
+void CodeBook::encode_batches(OutputBitStream& out, const char *data, std::size_t size, SymbolSize<symbol_size>, CodeWordOf code_word) {
+  const std::size_t stride = batch * symbol_size;
+  std::size_t i = 0;
+  for (; i + stride <= size; i += stride) {
+    // The lookups are independent of each other; only the `put_bits`
+    // depends on the previous one.
+    std::uint64_t bits = 0;
+    int length = 0;
+    for (int j = 0; j < batch; ++j) {
+      const CodeWord& code = code_word(data + i + j * symbol_size);
+      bits |= code.bits << length;
+      length += code.length;
+    }
+    out.put_bits(bits, length);
+  }
+  for (; i < size; i += symbol_size) {
+    const CodeWord& code = code_word(data + i);
+    out.put_bits(code.bits, code.length);
+  }
+}
+
+HUFFER_KERNEL
+inline
+void CodeBook::encode(OutputBitStream& out, const char *data, std::size_t size) {
+  const auto encode = [&](auto width, auto code_word) {
+    if (4 * longest <= 64) {
+      encode_batches<4>(out, data, size, width, code_word);
+    } else if (2 * longest <= 64) {
+      encode_batches<2>(out, data, size, width, code_word);
+    } else {
+      encode_batches<1>(out, data, size, width, code_word);
+    }
+  };
+
+  with_symbol_size(symbols->symbol_size(), [&](auto width) {
+    if constexpr (dense_symbols(width)) {
+      encode(width, [this, width](const char *symbol) -> const CodeWord& {
+        return dense[dense_index(symbol, width)];
+      });
+    } else {
+      const SymbolTable& info = symbols->info;
+      encode(width, [&info, width](const char *symbol) -> const CodeWord& {
+        return info.find(info.key(symbol, width))->code_word;
+      });
+    }
+  });
+}
+
+inline
+void CodeBook::encode(OutputBitStream& out, const char *data, std::size_t size, const CodeWord& escape) {
+  const std::size_t symbol_size = symbols->symbol_size();
+  for (std::size_t i = 0; i < size; i += symbol_size) {
+    const CodeWord *code;
+    if (dense_symbols(symbol_size)) {
+      code = &dense[dense_index(data + i, symbol_size)];
+    } else {
+      const SymbolInfo *info = symbols->info.find(symbols->info.key(data + i));
+      code = info ? &info->code_word : nullptr;
+    }
+    if (code && code->length != 0) {
+      out.put_bits(code->bits, code->length);
+      continue;
+    }
+    out.put_bits(escape.bits, escape.length);
+    for (std::size_t j = 0; j < symbol_size; ++j) {
+      out << data[i + j];
+    }
+  }
+}
+
+// Write the specified `symbol`, which is the specified `symbol_size` bytes.
+inline
+void write_symbol(OutputBitStream& out, const Symbol& symbol, std::size_t symbol_size) {
+  for (std::size_t i = 0; i < symbol_size; ++i) {
+    out << symbol[i];
+  }
+}
+
+// Write the specified `value` using Elias gamma coding: one fewer zero bits
+// than there are significant bits in `value`, followed by the significant
+// bits, most significant first. The behavior is undefined unless `value` is
+// positive.
+inline
+void write_gamma(OutputBitStream& out, std::uint64_t value) {
+  assert(value != 0);
+  const int width = std::bit_width(value);
+  for (int i = 1; i < width; ++i) {
+    out << false;
+  }
+  for (int i = width - 1; i >= 0; --i) {
+    out << bool((value >> i) & 1);
+  }
+}
+
+inline
+void write_code_lengths(OutputBitStream& out, const std::vector<CodeLength>& lengths, std::size_t symbol_size) {
+  if (lengths.empty()) {
+    return;
+  }
+
+  // The format for code lengths is <max><counts><symbols>.
+  // <max> is the longest code word length minus one, in six bits.
+  // <counts> is, for each length from 1 through the longest, one more than
+  // the number of symbols whose code words have that length, written using
+  // Elias gamma coding.
+  // <symbols> are the symbols in canonical order.
+  const int longest = lengths.back().length;
+  out << std::bitset<6>(longest - 1);
+  auto entry = lengths.begin();
+  for (int length = 1; length <= longest; ++length) {
+    std::uint64_t count = 0;
+    for (; entry != lengths.end() && entry->length == length; ++entry) {
+      ++count;
+    }
+    write_gamma(out, count + 1);
+  }
+  for (const CodeLength& entry : lengths) {
+    write_symbol(out, entry.symbol, symbol_size);
+  }
+}
+
+// Return the number of bits that `write_code_lengths` writes for the
+// specified `lengths`, which are of symbols of the specified `symbol_size`
+// and are in canonical order.
+inline
+std::uint64_t code_lengths_bits(const std::vector<CodeLength>& lengths, std::size_t symbol_size) {
+  if (lengths.empty()) {
+    return 0;
+  }
+  std::uint64_t bits = 6 + lengths.size() * 8 * symbol_size;
+  auto entry = lengths.begin();
+  for (int length = 1; length <= lengths.back().length; ++length) {
+    std::uint64_t count = 0;
+    for (; entry != lengths.end() && entry->length == length; ++entry) {
+      ++count;
+    }
+    // See `write_gamma`.
+    bits += 2 * std::bit_width(count + 1) - 1;
+  }
+  return bits;
+}
+
+// Return the number of bits that the code words of the specified `symbols`
+// occupy when their lengths are the specified `lengths`.
+inline
+std::uint64_t code_words_bits(const Symbols& symbols, const std::vector<CodeLength>& lengths) {
+  std::uint64_t bits = 0;
+  for (const CodeLength& entry : lengths) {
+    bits += symbols.info.find(entry.symbol)->frequency * entry.length;
+  }
+  return bits;
+}
+
+// Return a lower bound on the number of bits that the code lengths and code
+// words of the specified `symbols` can occupy: the entropy of the symbols,
+// plus the symbols themselves as written in the code lengths. This is much
+// cheaper to compute than the code.
+inline
+double min_coded_bits(const Symbols& symbols) {
+  std::uint64_t count = 0;
+  for (const SymbolTable::Entry& entry : symbols.info) {
+    count += entry.info.frequency;
+  }
+  double bits = double(symbols.info.size()) * 8 * symbols.symbol_size();
+  for (const SymbolTable::Entry& entry : symbols.info) {
+    const double frequency = entry.info.frequency;
+    bits += frequency * std::log2(count / frequency);
+  }
+  return bits;
+}
+
+// Read into the specified `symbol` a symbol of the specified `symbol_size`
+// written by `write_symbol`.
+inline
+InputBitStream& read_symbol(InputBitStream& in, Symbol& symbol, std::size_t symbol_size) {
+  for (std::size_t i = 0; i < symbol_size; ++i) {
+    in >> symbol[i];
+  }
+  return in;
+}
+
+inline
+Tree read_tree(InputBitStream& in, std::size_t symbol_size) {
+  // If an error occurs, return an empty tree.
+
+  // The format for a node is <type><payload>.
+  // <type> is a single bit: 0 means "internal" and 1 means "leaf."
+  // <payload> for a leaf is the symbol.
+  // <payload> for a node is the left child followed by the right child.
+  // The nodes are stored in the order they're read, so the root is first.
+  Tree tree;
+  std::vector<Node>& nodes = tree.nodes;
+  // `ancestors` are the indices of internal nodes whose children have not
+  // all been read yet. The root is never a child, so a child index of zero
+  // means "not read yet."
+  std::vector<std::uint32_t> ancestors;
+  std::uint32_t next_node_id = 1;
+  do {
+    if (!ancestors.empty()) {
+      const Node& parent = nodes[ancestors.back()];
+      assert(parent.type == Node::Type::internal);
+      if (parent.internal.left && parent.internal.right) {
+        ancestors.pop_back();
+        continue;
+      }
+    }
+
+    bool is_leaf;
+    in >> is_leaf;
+    if (!in) {
+      return Tree{};
+    }
+
+    const std::uint32_t index = nodes.size();
+#pragma GCC diagnostic push
+    // You're wrong, GCC. You're WRONG.
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+    if (is_leaf) {
+#pragma GCC diagnostic pop
+      Symbol symbol;
+      if (!read_symbol(in, symbol, symbol_size)) {
+        return Tree{};
+      }
+      nodes.push_back(Node{
+        .weight = 0, // unused
+        .type = Node::Type::leaf,
+        .leaf = symbol
+      });
+    } else {
+      // It's an internal node.
+      nodes.push_back(Node{
+        .weight = 0, // unused
+        .type = Node::Type::internal,
+        .internal = {
+          .id = next_node_id++,
+          .left = 0, // TBD
+          .right = 0 // TBD
+        }
+      });
+    }
+
+    if (!ancestors.empty()) {
+      Node& parent = nodes[ancestors.back()];
+      if (parent.internal.left == 0) {
+        parent.internal.left = index;
+      } else {
+        parent.internal.right = index;
+      }
+    }
+    if (!is_leaf) {
+      ancestors.push_back(index);
+    }
+  } while (!ancestors.empty());
+
+  return tree;
+}
+
+// Read into the specified `value` an integer written by `write_gamma`.
+inline
+InputBitStream& read_gamma(InputBitStream& in, std::uint64_t& value) {
+  int width = 1;
+  bool bit = false;
+  while (in >> bit && !bit) {
+    if (++width > 64) {
+      in.fail(true);
+      return in;
+    }
+  }
+  if (!in) {
+    return in;
+  }
+  value = 1;
+  for (int i = 1; i < width && in >> bit; ++i) {
+    value = (value << 1) | bit;
+  }
+  return in;
+}
+
+inline
+std::vector<CodeLength> read_code_lengths(InputBitStream& in, std::size_t symbol_size) {
+  // If an error occurs, return an empty vector.
+  // See `write_code_lengths` for a description of the format.
+  std::bitset<6> raw_longest;
+  if (!(in >> raw_longest)) {
+    return {};
+  }
+  const int longest = raw_longest.to_ulong() + 1;
+
+  // Verify that the lengths describe a prefix code, i.e. that there are never
+  // more code words of a given length than there are unused prefixes of that
+  // length. `available` saturates, since once it exceeds the number of
+  // symbols it can never again be exceeded.
+  std::vector<std::uint64_t> counts(longest + 1);
+  std::uint64_t available = 1;
+  std::uint64_t total = 0;
+  for (int length = 1; length <= longest; ++length) {
+    std::uint64_t count = 0;
+    if (!read_gamma(in, count)) {
+      return {};
+    }
+    counts[length] = --count;
+    available = std::min(available, std::uint64_t(1) << 62) * 2;
+    if (count > available) {
+      return {};
+    }
+    available -= count;
+    total += count;
+  }
+  if (total == 0) {
+    return {};
+  }
+
+  std::vector<CodeLength> lengths;
+  for (int length = 1; length <= longest; ++length) {
+    for (std::uint64_t i = 0; i < counts[length]; ++i) {
+      Symbol symbol;
+      if (!read_symbol(in, symbol, symbol_size)) {
+        return {};
+      }
+      lengths.push_back({.symbol = symbol, .length = length});
+    }
+  }
+  return lengths;
+}
+
+// `DecodeTable` is a multi-level lookup table that maps input bits directly to
+// decoded symbols, so that decoding does not have to walk a `Tree` one bit at
+// a time.
+// The primary table is indexed by the next `primary_bits()` bits of input,
+// least significant bit first. An entry either identifies a symbol and the
+// length of its code word, or, for code words longer than the primary table
+// can resolve, refers to a secondary table that is indexed by the bits that
+// follow. Secondary tables can themselves refer to further tables, so there
+// is no limit on code word length.
+class DecodeTable {
+public:
+  struct Entry {
+    enum class Kind : std::uint8_t {
+      // No code word begins with these bits. This happens only when the tree
+      // is a single leaf, whose code word is "0."
+      invalid,
+      // `symbol` is the decoded symbol, and `length` is the number of bits
+      // in its code word that were not consumed by previous tables.
+      symbol,
+      // `length` bits are to be consumed, and then the next `next_bits` bits
+      // index the table that begins at `entries[offset]`.
+      subtable,
+      // `length` is the number of bits in the escape code word (see
+      // `CodeTable`) that were not consumed by previous tables.
+      escape
+    };
+    Symbol symbol;
+    std::uint32_t offset;
+    std::uint8_t length;
+    std::uint8_t next_bits;
+    Kind kind;
+  };
+
+  // `max_bits` is the largest index width of any table. The primary table is
+  // sized to fit in a typical L1 data cache.
+  static constexpr int max_bits = 11;
+
+private:
+  std::vector<Entry> entries;
+  int bits;
+
+public:
+  // Create a table that decodes nothing. Every entry of the primary table is
+  // invalid.
+  DecodeTable();
+
+  // Build a table that decodes the code words described by the specified
+  // `tree`. The behavior is undefined if `tree` is empty.
+  explicit DecodeTable(const Tree& tree);
+
+  // Build a table that decodes the canonical code words described by the
+  // specified `lengths`, which must be nonempty, in canonical order, and
+  // describe a prefix code. If the optionally specified `escape` is `true`,
+  // then the last code word is an escape code word (see `CodeTable`).
+  explicit DecodeTable(const std::vector<CodeLength>& lengths, bool escape = false);
+
+  // Replace the contents of this table with those that the corresponding
+  // constructor would build, reusing the storage of the previous entries.
+  void assign(const Tree& tree);
+  void assign(const std::vector<CodeLength>& lengths, bool escape = false);
+
+  int primary_bits() const { return bits; }
+
+  // Return the primary table, which is followed by the secondary tables.
+  // An entry's `offset` is relative to the beginning of the primary table.
+  const Entry *data() const { return entries.data(); }
+
+  // Return the entry in the primary table for the specified `index`, or in
+  // the secondary table referred to by the specified `parent`.
+  const Entry& lookup(std::uint64_t index) const { return entries[index]; }
+  const Entry& lookup(const Entry& parent, std::uint64_t index) const {
+    return entries[parent.offset + index];
+  }
+
+private:
+  // Return the number of bits needed to index a table for the subtree of the
+  // specified `tree` rooted at the specified `root`, i.e. the height of the
+  // subtree, but no more than `max_bits`.
+  static int table_bits(const Tree& tree, const Node *root);
+};
+
+inline
+int DecodeTable::table_bits(const Tree& tree, const Node *root) {
+  struct Visit {
+    const Node *node;
+    int depth;
+  };
+  std::vector<Visit> stack;
+  stack.push_back({.node = root, .depth = 0});
+  int height = 0;
+  do {
+    const auto [node, depth] = stack.back();
+    stack.pop_back();
+    height = std::max(height, depth);
+    if (node->type == Node::Type::leaf || depth == max_bits) {
+      continue;
+    }
+    stack.push_back({.node = &tree.left(*node), .depth = depth + 1});
+    stack.push_back({.node = &tree.right(*node), .depth = depth + 1});
+  } while (!stack.empty());
+  return height;
+}
+
+inline
+DecodeTable::DecodeTable()
+: entries(1)
+, bits(0) {
+}
+
+inline
+DecodeTable::DecodeTable(const Tree& tree) {
+  assign(tree);
+}
+
+inline
+void DecodeTable::assign(const Tree& tree) {
+  assert(!tree.empty());
+  const Node *root = &tree.root();
+  entries.clear();
+
+  // Corner case: If there's only one symbol, then it codes to "0".
+  if (root->type == Node::Type::leaf) {
+    bits = 1;
+    entries.resize(2);
+    entries[0] = {.symbol = root->leaf, .offset = 0, .length = 1, .next_bits = 0, .kind = Entry::Kind::symbol};
+    entries[1].kind = Entry::Kind::invalid;
+    return;
+  }
+
+  // Each `Level` is a table yet to be filled. `root` is the node reached by
+  // the bits consumed before the table is indexed.
+  struct Level {
+    const Node *root;
+    std::uint32_t offset;
+    int bits;
+  };
+  bits = table_bits(tree, root);
+  entries.resize(std::size_t(1) << bits);
+  std::vector<Level> levels;
+  levels.push_back({.root = root, .offset = 0, .bits = bits});
+
+  // `code` is the bits leading from a level's root to `node`, where the first
+  // bit is the least significant.
+  struct Visit {
+    const Node *node;
+    int depth;
+    std::uint32_t code;
+  };
+  std::vector<Visit> stack;
+  do {
+    const Level level = levels.back();
+    levels.pop_back();
+    stack.push_back({.node = level.root, .depth = 0, .code = 0});
+    do {
+      const auto [node, depth, code] = stack.back();
+      stack.pop_back();
+      if (node->type == Node::Type::leaf) {
+        // Every index that begins with `code` decodes to this leaf.
+        const Entry entry{.symbol = node->leaf, .offset = 0, .length = std::uint8_t(depth), .next_bits = 0, .kind = Entry::Kind::symbol};
+        for (std::uint32_t suffix = 0; suffix < (std::uint32_t(1) << (level.bits - depth)); ++suffix) {
+          entries[level.offset + (code | (suffix << depth))] = entry;
+        }
+      } else if (depth == level.bits) {
+        // The code words under `node` are too long for this table, so they
+        // continue in another table.
+        const int next_bits = table_bits(tree, node);
+        const std::uint32_t offset = entries.size();
+        entries.resize(entries.size() + (std::size_t(1) << next_bits));
+        entries[level.offset + code] = {.symbol = {}, .offset = offset, .length = std::uint8_t(depth), .next_bits = std::uint8_t(next_bits), .kind = Entry::Kind::subtable};
+        levels.push_back({.root = node, .offset = offset, .bits = next_bits});
+      } else {
+        stack.push_back({.node = &tree.left(*node), .depth = depth + 1, .code = code});
+        stack.push_back({.node = &tree.right(*node), .depth = depth + 1, .code = code | (std::uint32_t(1) << depth)});
+      }
+    } while (!stack.empty());
+  } while (!levels.empty());
+}
+
+inline
+DecodeTable::DecodeTable(const std::vector<CodeLength>& lengths, bool escape) {
+  assign(lengths, escape);
+}
+
+inline
+void DecodeTable::assign(const std::vector<CodeLength>& lengths, bool escape) {
+  assert(!lengths.empty());
+
+  std::vector<CodeWord> codes(lengths.size());
+  for_each_code_word(lengths, [&](std::size_t i, CodeWord code_word) {
+    codes[i] = code_word;
+  });
+
+  // Canonical code words are in lexicographic order, so the code words that
+  // a secondary table decodes (those sharing a prefix) are contiguous.
+  // Each `Level` is a table yet to be filled with the code words
+  // `codes[first]` through `codes[last - 1]`, each of which begins with the
+  // same `consumed` bits.
+  struct Level {
+    std::uint32_t offset;
+    int bits;
+    int consumed;
+    std::size_t first;
+    std::size_t last;
+  };
+  bits = std::min(max_bits, lengths.back().length);
+  entries.clear();
+  entries.resize(std::size_t(1) << bits);
+  std::vector<Level> levels;
+  levels.push_back({.offset = 0, .bits = bits, .consumed = 0, .first = 0, .last = codes.size()});
+  do {
+    const Level level = levels.back();
+    levels.pop_back();
+    const std::uint64_t mask = (std::uint64_t(1) << level.bits) - 1;
+    std::size_t i = level.first;
+    while (i < level.last) {
+      const CodeWord& code = codes[i];
+      const std::uint64_t index = (code.bits >> level.consumed) & mask;
+      const int remaining = code.length - level.consumed;
+      if (remaining <= level.bits) {
+        // Every index that begins with the rest of `code` decodes to it.
+        const Entry::Kind kind = escape && i + 1 == lengths.size() ? Entry::Kind::escape : Entry::Kind::symbol;
+        const Entry entry{.symbol = lengths[i].symbol, .offset = 0, .length = std::uint8_t(remaining), .next_bits = 0, .kind = kind};
+        for (std::uint64_t suffix = 0; suffix < (std::uint64_t(1) << (level.bits - remaining)); ++suffix) {
+          entries[level.offset + (index | (suffix << remaining))] = entry;
+        }
+        ++i;
+        continue;
+      }
+
+      // The code words beginning with `index` are too long for this table,
+      // so they continue in another table.
+      std::size_t end = i;
+      int longest = 0;
+      while (end < level.last && ((codes[end].bits >> level.consumed) & mask) == index) {
+        longest = std::max(longest, codes[end].length);
+        ++end;
+      }
+      const int consumed = level.consumed + level.bits;
+      const int next_bits = std::min(max_bits, longest - consumed);
+      const std::uint32_t offset = entries.size();
+      entries.resize(entries.size() + (std::size_t(1) << next_bits));
+      entries[level.offset + index] = {.symbol = {}, .offset = offset, .length = std::uint8_t(level.bits), .next_bits = std::uint8_t(next_bits), .kind = Entry::Kind::subtable};
+      levels.push_back({.offset = offset, .bits = next_bits, .consumed = consumed, .first = i, .last = end});
+      i = end;
+    }
+  } while (!levels.empty());
+}
+
+// Decode a symbol from the specified `in` using the specified `table`, and
+// store it as a whole `Symbol` at the specified `output`. Return whether the
+// input contained a valid code word. An escape code word is followed by the
+// symbol itself, which is the specified `symbol_size` bytes.
+inline bool decode_symbol(InputBitStream& in, const DecodeTable& table, std::size_t symbol_size, char *output) {
+  const DecodeTable::Entry *entry = &table.lookup(in.peek(table.primary_bits()));
+  while (entry->kind == DecodeTable::Entry::Kind::subtable) {
+    in.consume(entry->length);
+    entry = &table.lookup(*entry, in.peek(entry->next_bits));
+  }
+  if (entry->kind != DecodeTable::Entry::Kind::symbol) {
+    Symbol symbol;
+    if (entry->kind != DecodeTable::Entry::Kind::escape || !in.consume(entry->length) || !read_symbol(in, symbol, symbol_size)) {
+      return false;
+    }
+    std::memcpy(output, symbol.data(), sizeof(Symbol));
+    return true;
+  }
+  if (!in.consume(entry->length)) {
+    return false;
+  }
+  std::memcpy(output, entry->symbol.data(), sizeof(Symbol));
+  return true;
+}
+
+// `BitCursor` reads bits from bytes in memory, like an `InputBitStream` over
+// memory, but it is small enough to live in registers during a decoding loop,
+// and it does not set status bits. Instead, consuming more bits than the input
+// contains makes `overrun()` return `true`, after which the cursor must not be
+// used.
+class BitCursor {
+  // `buffer`, `buffered`, `next`, and `end` are as in `InputBitStream`.
+  std::uint64_t buffer;
+  int buffered;
+  const char *next;
+  const char *end;
+
+public:
+  BitCursor()
+  : BitCursor(nullptr, 0) {
+  }
+
+  BitCursor(const char *data, std::size_t size)
+  : buffer(0)
+  , buffered(0)
+  , next(data)
+  , end(data + size) {
+  }
+
+  // Buffer at least 56 bits, or all of the remaining input if there is less.
+  void refill() {
+    if (end - next < 8) {
+      refill_tail();
+      return;
+    }
+    std::uint64_t word = 0;
+    if constexpr (std::endian::native == std::endian::little) {
+      std::memcpy(&word, next, 8);
+    } else {
+      for (int i = 0; i < 8; ++i) {
+        word |= std::uint64_t(std::uint8_t(next[i])) << (8 * i);
+      }
+    }
+    buffer |= word << buffered;
+    next += (63 - buffered) / 8;
+    buffered |= 56;
+  }
+
+  // Buffer the remaining bytes of input, fewer than eight, one at a time.
+  // This is separate from `refill` to keep `refill` small enough to inline.
+  void refill_tail();
+
+  // Return the next `count` bits without consuming them. The behavior is
+  // undefined unless `0 <= count && count <= 56`.
+  std::uint64_t peek(int count) const {
+    return buffer & ((std::uint64_t(1) << count) - 1);
+  }
+
+  // Discard the next `count` bits. The behavior is undefined unless
+  // `0 <= count && count <= 56`.
+  void consume(int count) {
+    buffer >>= count;
+    buffered -= count;
+  }
+
+  bool overrun() const { return buffered < 0; }
+};
+
+inline
+void BitCursor::refill_tail() {
+  while (buffered <= 64 - 8 && next != end) {
+    buffer |= std::uint64_t(std::uint8_t(*next++)) << buffered;
+    buffered += 8;
+  }
+}
+
+// Return the entry for the code word beginning with the specified `entry`,
+// which refers to a secondary table of the specified `table` (see
+// `DecodeTable::data`), consuming bits from the specified `in` as it goes.
+// This is the uncommon case of `decode_symbol`, kept separate so that the
+// common case is small enough to inline.
+inline
+const DecodeTable::Entry& decode_long(BitCursor& in, const DecodeTable::Entry *table, const DecodeTable::Entry& entry) {
+  const DecodeTable::Entry *current = &entry;
+  do {
+    in.consume(current->length);
+    in.refill();
+    current = &table[current->offset + in.peek(current->next_bits)];
+  } while (current->kind == DecodeTable::Entry::Kind::subtable);
+  return *current;
+}
+
+// Decode a symbol from the specified `in` using the specified `table` (see
+// `DecodeTable::data`), whose primary table is indexed by the specified
+// `primary_bits` bits, and store it as a whole `Symbol` at the specified
+// `output`. Return whether the input contained a valid code word.
+// The table is passed as a pointer rather than as a `DecodeTable`, so that
+// the caller can keep it in a register: stores through `output` could
+// otherwise modify a `DecodeTable`, as far as the compiler knows.
+inline bool decode_symbol(BitCursor& in, const DecodeTable::Entry *table, int primary_bits, char *output) {
+  in.refill();
+  const DecodeTable::Entry *entry = &table[in.peek(primary_bits)];
+  if (entry->kind == DecodeTable::Entry::Kind::subtable) {
+    entry = &decode_long(in, table, *entry);
+  }
+  if (entry->kind == DecodeTable::Entry::Kind::invalid) {
+    return false;
+  }
+  in.consume(entry->length);
+  if (in.overrun()) {
+    return false;
+  }
+  std::memcpy(output, entry->symbol.data(), sizeof(Symbol));
+  return true;
+}
+
+// Decode the specified `count` symbols of the specified `symbol_size` from
+// the specified `in` using the specified `table`, and store them contiguously
+// starting at the specified `output`, which must have room for
+// `count * symbol_size + sizeof(Symbol)` bytes. Return whether the input
+// contained `count` valid code words.
+// Each symbol is stored as a whole `Symbol`, which the next symbol then
+// partially overwrites; hence the extra room.
+HUFFER_KERNEL
+inline
+bool decode_symbols(InputBitStream& in, const DecodeTable& table, std::size_t symbol_size, std::uint64_t count, char *output) {
+  return with_symbol_size(symbol_size, [&](auto width) {
+    for (std::uint64_t i = 0; i < count; ++i) {
+      if (!decode_symbol(in, table, width, output)) {
+        return false;
+      }
+      output += width;
+    }
+    return true;
+  });
+}
+
+// Decode the specified `count` symbols of the specified `symbol_size` from
+// the specified `in` using the specified `table`, and write them to the
+// specified `out` a large chunk at a time. Return whether the input contained
+// `count` valid code words.
+inline
+bool decode_symbols(InputBitStream& in, const DecodeTable& table, std::size_t symbol_size, std::uint64_t count, std::ostream& out) {
+  const std::uint64_t chunk_symbols = (1 << 20) / symbol_size;
+  std::vector<char> chunk(chunk_symbols * symbol_size + sizeof(Symbol));
+  while (count != 0) {
+    const std::uint64_t n = std::min(count, chunk_symbols);
+    if (!decode_symbols(in, table, symbol_size, n, chunk.data())) {
+      return false;
+    }
+    out.write(chunk.data(), n * symbol_size);
+    count -= n;
+  }
+  return true;
+}
+
+// `ArrayBuf` is a read-only `std::streambuf` over a contiguous sequence of
+// bytes that it does not own.
+class ArrayBuf : public std::streambuf {
+protected:
+  pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) override {
+    const char *base = direction == std::ios_base::beg ? eback()
+                     : direction == std::ios_base::cur ? gptr()
+                     : egptr();
+    const off_type position = (base - eback()) + offset;
+    if (!(which & std::ios_base::in) || position < 0 || position > egptr() - eback()) {
+      return pos_type(off_type(-1));
+    }
+    setg(eback(), eback() + position, egptr());
+    return pos_type(position);
+  }
+
+  pos_type seekpos(pos_type position, std::ios_base::openmode which) override {
+    return seekoff(off_type(position), std::ios_base::beg, which);
+  }
+
+public:
+  ArrayBuf(const char *data, std::size_t size) {
+    char *begin = const_cast<char*>(data);
+    setg(begin, begin, begin + size);
+  }
+};
+
+// `OutputArrayBuf` is a write-only `std::streambuf` over a contiguous
+// sequence of bytes that it does not own. Writing beyond the end fails.
+class OutputArrayBuf : public std::streambuf {
+public:
+  OutputArrayBuf() = default;
+
+  OutputArrayBuf(char *data, std::size_t size) {
+    reset(data, size);
+  }
+
+  // Write subsequent output to the specified `size` bytes at the specified
+  // `data`, forgetting any previous output.
+  void reset(char *data, std::size_t size) {
+    setp(data, data + size);
+  }
+
+  // Return the number of bytes written.
+  std::size_t size() const { return pptr() - pbase(); }
+};
+
+// Write the specified `value` to the specified `out` as eight bytes, least
+// significant first.
+inline
+std::ostream& write_u64(std::ostream& out, std::uint64_t value) {
+  char bytes[8];
+  for (int i = 0; i < 8; ++i) {
+    bytes[i] = char(std::uint8_t(value >> (8 * i)));
+  }
+  return out.write(bytes, sizeof bytes);
+}
+
+// Read into the specified `value` eight bytes from the specified `in`, least
+// significant first.
+inline
+std::istream& read_u64(std::istream& in, std::uint64_t& value) {
+  char bytes[8];
+  if (in.read(bytes, sizeof bytes)) {
+    value = 0;
+    for (int i = 0; i < 8; ++i) {
+      value |= std::uint64_t(std::uint8_t(bytes[i])) << (8 * i);
+    }
+  }
+  return in;
+}
+
+// `context_count` is the number of contexts of an order-1 model, in which each
+// context has its own code (see `BlockKind::huffman_context`). The context of
+// a symbol is the last byte of the symbol before it, or zero for the first
+// symbol.
+constexpr std::size_t context_count = 256;
+
+// Return the context of the symbol that follows the symbol of the specified
+// `symbol_size` whose bytes begin at the specified `data`.
+inline
+std::size_t next_context(const char *data, std::size_t symbol_size) {
+  return std::uint8_t(data[symbol_size - 1]);
+}
+
+// Return, for each context, the frequency of each symbol of the specified
+// `symbol_size` that appears in that context in the specified `size` bytes at
+// the specified `data`. The behavior is undefined unless `size` is a multiple
+// of `symbol_size`.
+// Single byte symbols are counted into one flat array indexed by context and
+// symbol. Wider symbols would make the array too large, so they are counted
+// into a table for each context.
+inline
+std::vector<Symbols> read_context_symbols(const char *data, std::size_t size, std::size_t symbol_size) {
+  assert(size % symbol_size == 0);
+  std::vector<Symbols> symbols(context_count, Symbols{symbol_size});
+  std::size_t context = 0;
+  if (symbol_size == 1) {
+    std::vector<std::uint64_t> histogram(context_count * 256);
+    for (std::size_t i = 0; i < size; ++i) {
+      const std::size_t byte = std::uint8_t(data[i]);
+      ++histogram[context << 8 | byte];
+      context = byte;
+    }
+    for (std::size_t index = 0; index < histogram.size(); ++index) {
+      if (histogram[index] != 0) {
+        symbols[index >> 8].info.add(dense_symbol(index & 0xff), histogram[index]);
+      }
+    }
+  } else {
+    with_symbol_size(symbol_size, [&](auto width) {
+      for (std::size_t i = 0; i < size; i += width) {
+        SymbolTable& info = symbols[context].info;
+        info.add(info.key(data + i, width), 1);
+        context = next_context(data + i, width);
+      }
+    });
+  }
+  for (Symbols& counted : symbols) {
+    for (const SymbolTable::Entry& entry : counted.info) {
+      counted.total_size += entry.info.frequency * symbol_size;
+    }
+  }
+  return symbols;
+}
+
+// Return, for each of the specified `symbols`, one per context, the canonical
+// code lengths of its symbols, no longer than the specified
+// `max_code_length`. A context that has no symbols has no code lengths.
+inline
+std::vector<std::vector<CodeLength>> build_context_code_lengths(const std::vector<Symbols>& symbols, int max_code_length) {
+  std::vector<std::vector<CodeLength>> lengths(symbols.size());
+  for (std::size_t context = 0; context < symbols.size(); ++context) {
+    if (symbols[context].info.size() != 0) {
+      lengths[context] = build_code_lengths(symbols[context], max_code_length);
+      sort_canonical(lengths[context]);
+    }
+  }
+  return lengths;
+}
+
+// Write to the specified `out` the specified `lengths`, one per context, of
+// symbols of the specified `symbol_size`.
+inline
+void write_context_code_lengths(OutputBitStream& out, const std::vector<std::vector<CodeLength>>& lengths, std::size_t symbol_size) {
+  // The format is <present><code lengths>..., where <present> is a bit for
+  // each context, one if the context has code lengths, and each <code
+  // lengths> is those of a context that has them (see `write_code_lengths`),
+  // in the order of the contexts.
+  for (const std::vector<CodeLength>& context : lengths) {
+    out << !context.empty();
+  }
+  for (const std::vector<CodeLength>& context : lengths) {
+    write_code_lengths(out, context, symbol_size);
+  }
+}
+
+// Return the number of bits that `write_context_code_lengths` writes for the
+// specified `lengths` of symbols of the specified `symbol_size`.
+inline
+std::uint64_t context_code_lengths_bits(const std::vector<std::vector<CodeLength>>& lengths, std::size_t symbol_size) {
+  std::uint64_t bits = lengths.size();
+  for (const std::vector<CodeLength>& context : lengths) {
+    bits += code_lengths_bits(context, symbol_size);
+  }
+  return bits;
+}
+
+// Read code lengths of symbols of the specified `symbol_size` written by
+// `write_context_code_lengths` from the specified `in`. If an error occurs,
+// or if no context has code lengths, return an empty vector.
+inline
+std::vector<std::vector<CodeLength>> read_context_code_lengths(InputBitStream& in, std::size_t symbol_size) {
+  bool present[context_count];
+  bool any = false;
+  for (bool& bit : present) {
+    if (!in.get(bit)) {
+      return {};
+    }
+    any = any || bit;
+  }
+  if (!any) {
+    return {};
+  }
+  std::vector<std::vector<CodeLength>> lengths(context_count);
+  for (std::size_t context = 0; context < context_count; ++context) {
+    if (present[context] && (lengths[context] = read_code_lengths(in, symbol_size)).empty()) {
+      return {};
+    }
+  }
+  return lengths;
+}
+
+// `ContextCodeBook` maps symbols to code words for encoding in an order-1
+// model (see `context_count`). The code words of single byte symbols are kept
+// in a flat array indexed by context and symbol. Otherwise, they're kept in
+// each context's `Symbols::info`.
+class ContextCodeBook {
+  std::vector<Symbols> *symbols;
+  std::vector<CodeWord> dense;
+
+public:
+  // Assign code words to the specified `symbols`, one per context, as
+  // described by the specified `lengths`, one per context, each of which must
+  // be in canonical order.
+  ContextCodeBook(std::vector<Symbols>& symbols, const std::vector<std::vector<CodeLength>>& lengths);
+
+  // Write to the specified `out` the code word of each symbol in the
+  // specified `size` bytes at the specified `data`, in that symbol's context.
+  // The behavior is undefined unless `size` is a multiple of the symbol size
+  // and each symbol has a code word in its context.
+  void encode(OutputBitStream& out, const char *data, std::size_t size) const;
+};
+
+inline
+ContextCodeBook::ContextCodeBook(std::vector<Symbols>& symbols, const std::vector<std::vector<CodeLength>>& lengths)
+: symbols(&symbols) {
+  if (symbols.front().symbol_size() == 1) {
+    dense.assign(context_count * 256, CodeWord{});
+    for (std::size_t context = 0; context < context_count; ++context) {
+      const std::vector<CodeLength>& code = lengths[context];
+      for_each_code_word(code, [&](std::size_t i, CodeWord code_word) {
+        dense[context << 8 | std::uint8_t(code[i].symbol[0])] = code_word;
+      });
+    }
+    return;
+  }
+  for (std::size_t context = 0; context < context_count; ++context) {
+    build_code_words(symbols[context], lengths[context]);
+  }
+}
+
+HUFFER_KERNEL
+inline
+void ContextCodeBook::encode(OutputBitStream& out, const char *data, std::size_t size) const {
+  std::size_t context = 0;
+  if (!dense.empty()) {
+    for (std::size_t i = 0; i < size; ++i) {
+      const std::size_t byte = std::uint8_t(data[i]);
+      const CodeWord& code = dense[context << 8 | byte];
+      out.put_bits(code.bits, code.length);
+      context = byte;
+    }
+    return;
+  }
+  with_symbol_size(symbols->front().symbol_size(), [&](auto width) {
+    for (std::size_t i = 0; i < size; i += width) {
+      const SymbolTable& info = (*symbols)[context].info;
+      const CodeWord& code = info.find(info.key(data + i, width))->code_word;
+      out.put_bits(code.bits, code.length);
+      context = next_context(data + i, width);
+    }
+  });
+}
+
+// Decode the specified `count` symbols of the specified `symbol_size` from
+// the specified `in`, each using the one of the specified `tables` for its
+// context (see `context_count`), and store them as `decode_symbols` does at
+// the specified `output`. Return whether the input contained `count` valid
+// code words.
+HUFFER_KERNEL
+inline
+bool decode_context_symbols(InputBitStream& in, const std::vector<DecodeTable>& tables, std::size_t symbol_size, std::uint64_t count, char *output) {
+  return with_symbol_size(symbol_size, [&](auto width) {
+    std::size_t context = 0;
+    for (std::uint64_t i = 0; i < count; ++i) {
+      if (!decode_symbol(in, tables[context], width, output)) {
+        return false;
+      }
+      context = next_context(output, width);
+      output += width;
+    }
+    return true;
+  });
+}
+
+// Version 3 of the format divides the input into blocks, each of which has
+// its own code words and is encoded independently of the others.
+// The format for a file is <magic><symbol size><block>...<end>[<index>].
+// <magic> is "huffer3" followed by a null byte.
+// <symbol size> is one byte, the symbol size minus one.
+// <block> is <kind><decoded size><encoded size><encoded>, where <kind> is one
+// byte, <decoded size> and <encoded size> are eight bytes, least significant
+// first, and <encoded> is <encoded size> bytes.
+// <end> is a <kind> of zero.
+// For a block of kind `BlockKind::huffman`, <encoded> is the code lengths
+// (see `write_code_lengths`), followed by the code words of the block's
+// symbols, followed by any "extra," padded with zero bits to a whole byte.
+// Only the last block has "extra."
+// For a block of kind `BlockKind::huffman_streams`, the block's symbols are
+// divided into consecutive parts, each of which is encoded as a separate
+// stream of code words so that the parts can be decoded at the same time (see
+// `decode_streams`). <encoded> is <count><sizes><code lengths><stream>...
+// <extra>, where <count> is one byte, the number of streams, which is at least
+// two, <sizes> is the size in bytes of each stream, eight bytes each, least
+// significant first, <code lengths> is as above, padded with zero bits to a
+// whole byte, each <stream> is the code words of its part, padded with zero
+// bits to a whole byte, and <extra> is any "extra" bytes, verbatim. Each part
+// but the last has the block's symbol count divided by the stream count
+// (rounded down) symbols, and the last part has the rest.
+// For a block of kind `BlockKind::stored`, <encoded> is the decoded bytes
+// verbatim, and so <encoded size> is the same as <decoded size>. An encoder
+// stores a block that would not be smaller if it were coded.
+// For a block of kind `BlockKind::huffman_reuse` or
+// `BlockKind::huffman_streams_reuse`, <encoded> is as for `BlockKind::huffman`
+// or `BlockKind::huffman_streams`, respectively, but without <code lengths>.
+// Instead, the block's code is that of the nearest block before it of kind
+// `BlockKind::huffman` or `BlockKind::huffman_streams`. An encoder reuses the
+// code when the block would not be smaller with code lengths of its own.
+// For a block of kind `BlockKind::huffman_context`, each symbol is coded in
+// its context, using a code for each context (see `context_count`). <encoded>
+// is the code lengths of each context (see `write_context_code_lengths`),
+// followed by the code words of the block's symbols, followed by any "extra,"
+// padded with zero bits to a whole byte.
+// The optional <index> locates each block, so that part of the decoded output
+// can be found without reading the blocks before it. <index> is <entry>...
+// <count><index magic>, where each <entry> is <offset><decoded offset>, the
+// position of a block's <kind> in the file and the position of its first
+// decoded byte in the decoded output, in the order of the blocks, and <count>
+// is the number of entries, each eight bytes, least significant first.
+// <index magic> is "hufindex".
+enum class BlockKind : std::uint8_t {
+  end,
+  huffman,
+  huffman_streams,
+  stored,
+  huffman_reuse,
+  huffman_streams_reuse,
+  huffman_context
+};
+
+// `block_header_size` is the size of the part of a <block> that precedes
+// <encoded>, and `file_header_size` is the size of the part of a file that
+// precedes the first <block>.
+constexpr std::uint64_t block_header_size = 1 + 8 + 8;
+constexpr std::uint64_t file_header_size = 8 + 1;
+
+// `IndexEntry` is an <entry> in the <index> (see `BlockKind`).
+struct IndexEntry {
+  std::uint64_t offset;
+  std::uint64_t decoded_offset;
+};
+
+constexpr char index_magic[] = {'h', 'u', 'f', 'i', 'n', 'd', 'e', 'x'};
+
+// `max_block_size` is the largest decoded size of a block.
+constexpr std::uint64_t max_block_size = std::uint64_t(1) << 30;
+
+// Return the largest possible encoded size of a block whose decoded size is
+// the specified `decoded_size`. A single code word can be as long as the
+// maximum code length, but the average length of the code words of an optimal
+// or length limited code is less than the entropy plus one bit, which is at
+// most the symbol plus one bit. The code lengths cost little more than one
+// symbol for each distinct symbol, and so are not much larger than the
+// symbols themselves.
+inline
+std::uint64_t max_encoded_size(std::uint64_t decoded_size) {
+  return 3 * decoded_size + 4096;
+}
+
+// `max_streams` is the largest number of streams in a block of kind
+// `BlockKind::huffman_streams`.
+constexpr unsigned max_streams = 16;
+
+// `CodeTable` is a code built from a corpus (see `build_table_lengths`) and
+// saved to a file, so that small inputs like the corpus can be encoded
+// without code lengths of their own (see `write_version4`). Symbols that are
+// not in the corpus are encoded as an escape code word followed by the symbol
+// itself.
+// The format for a table file is <table magic><symbol size><code lengths>.
+// <table magic> is "huftable". <symbol size> is one byte, the symbol size
+// minus one. <code lengths> is as written by `write_code_lengths`, padded
+// with zero bits to a whole byte, where the last code word is the escape code
+// word, whose symbol is meaningless.
+struct CodeTable {
+  // `lengths` are in canonical order, and their last element is the escape.
+  std::vector<CodeLength> lengths;
+  // `fingerprint` identifies the table file, so that an input is not decoded
+  // with a table other than the one with which it was encoded.
+  std::uint32_t fingerprint;
+  std::size_t symbol_size;
+};
+
+constexpr char table_magic[] = {'h', 'u', 'f', 't', 'a', 'b', 'l', 'e'};
+
+// Return the 32-bit FNV-1a hash of the specified `size` bytes at the
+// specified `data`.
+inline
+std::uint32_t fingerprint(const char *data, std::size_t size) {
+  std::uint32_t hash = 2166136261u;
+  for (std::size_t i = 0; i < size; ++i) {
+    hash = (hash ^ std::uint8_t(data[i])) * 16777619u;
+  }
+  return hash;
+}
+
+// Load into the specified `table` the table file that is the specified `size`
+// bytes at the specified `data`. Return whether successful.
+inline
+bool read_table(const char *data, std::size_t size, CodeTable& table) {
+  if (size < sizeof table_magic + 1 ||
+      !std::equal(table_magic, table_magic + sizeof table_magic, data)) {
+    return false;
+  }
+  table.symbol_size = std::uint8_t(data[sizeof table_magic]) + 1;
+  if (table.symbol_size > max_symbol_size) {
+    return false;
+  }
+  const std::size_t header_size = sizeof table_magic + 1;
+  InputBitStream bitin{data + header_size, size - header_size};
+  table.lengths = read_code_lengths(bitin, table.symbol_size);
+  table.fingerprint = fingerprint(data, size);
+  return !table.lengths.empty();
+}
+
+// Return code lengths in canonical order for the specified `symbols`, none
+// longer than the specified `max_code_length`, followed by an escape code
+// word (see `CodeTable`). The behavior is undefined unless
+// `can_encode(symbols, max_code_length - 1)`.
+inline
+std::vector<CodeLength> build_table_lengths(const Symbols& symbols, int max_code_length) {
+  std::vector<CodeLength> lengths;
+  if (symbols.info.size() != 0) {
+    lengths = build_code_lengths(symbols, max_code_length - 1);
+    sort_canonical(lengths);
+  }
+
+  // A lone symbol's code word is "0," which leaves "1" for the escape.
+  // Otherwise the code is complete, so the last (and longest) code word is
+  // divided into two: one for its symbol, and one for the escape.
+  if (lengths.size() > 1) {
+    ++lengths.back().length;
+  }
+  const int length = lengths.empty() ? 1 : lengths.back().length;
+  lengths.push_back({.symbol = {}, .length = length});
+  return lengths;
+}
+
+// Assign to the specified `symbols` and `code_book` the code words of the
+// specified `table` other than the escape, and assign the escape code word
+// to the specified `escape`. The behavior is undefined unless `symbols` is
+// empty and has the table's symbol size.
+inline
+void assign_table(const CodeTable& table, Symbols& symbols, CodeBook& code_book, CodeWord& escape) {
+  // The code words are assigned to the symbols without the escape, and then
+  // the escape gets the code word that follows.
+  std::vector<CodeLength> lengths = table.lengths;
+  lengths.pop_back();
+  for (const CodeLength& entry : lengths) {
+    symbols.info.add(entry.symbol, 1);
+  }
+  code_book.assign(symbols, lengths);
+  for_each_code_word(table.lengths, [&](std::size_t, CodeWord code_word) {
+    escape = code_word;
+  });
+}
+
+// Write to the specified `out` the beginning of version 2 of the format: the
+// magic, the header, and the specified `lengths`, which describe the code of
+// the specified `symbols`.
+inline
+void write_version2_header(OutputBitStream& out, const Symbols& symbols, const std::vector<CodeLength>& lengths) {
+  for (const char byte : std::string_view{"huffer2", 8}) {
+    out << byte;
+  }
+  out << std::bitset<64>{symbols.total_size} << std::bitset<3>{symbols.symbol_size() - 1};
+  write_code_lengths(out, lengths, symbols.symbol_size());
+}
+
+// Write to the specified `out` the rest of version 2 of the format after
+// `write_version2_header`: the code words of the specified `data` according
+// to the specified `code_book`, and the "extra." The specified `symbols` are
+// those of `data`.
+inline
+void write_version2_code_words(OutputBitStream& out, const char *data, const Symbols& symbols, CodeBook& code_book) {
+  code_book.encode(out, data, symbols.total_size - symbols.extra.size());
+  // Copy the "extra" verbatim (unencoded).
+  for (const char byte : symbols.extra) {
+    out << byte;
+  }
+}
+
+// Write to the specified `out` version 2 of the format: the magic, the
+// header, the specified `lengths`, the code words of the specified `data`
+// according to the specified `code_book`, and the "extra." The specified
+// `symbols` are those of `data`, and `code_book` describes `lengths`.
+inline
+void write_version2(OutputBitStream& out, const char *data, const Symbols& symbols, const std::vector<CodeLength>& lengths, CodeBook& code_book) {
+  write_version2_header(out, symbols, lengths);
+  write_version2_code_words(out, data, symbols, code_book);
+}
+
+// Write to the specified `out` version 4 of the format for the specified
+// `size` bytes at the specified `data`, using the code words of the
+// specified `table`, which are assigned to the specified `code_book` and
+// `escape` (see `assign_table`).
+// The format is that of version 2, except that the code lengths are replaced
+// by the table's fingerprint in 32 bits, and the symbol size is that of the
+// table.
+inline
+void write_version4(OutputBitStream& out, const char *data, std::size_t size, const CodeTable& table, CodeBook& code_book, const CodeWord& escape) {
+  const std::size_t extra = size % table.symbol_size;
+  for (const char byte : std::string_view{"huffer4", 8}) {
+    out << byte;
+  }
+  out << std::bitset<64>{size} << std::bitset<3>{table.symbol_size - 1}
+      << std::bitset<32>{table.fingerprint};
+  code_book.encode(out, data, size - extra, escape);
+  for (std::size_t i = size - extra; i < size; ++i) {
+    out << data[i];
+  }
+}
+
+// Return the version of the format whose magic is the eight bytes at the
+// specified `magic`, or return zero if they are not a magic that can be
+// decoded.
+// Version 1 of the format describes code words by the shape of the tree.
+// Version 2 describes canonical code words by their lengths.
+// Version 3 divides the input into blocks (see `BlockKind`).
+// Version 4 uses code words from a separate table file (see `CodeTable`).
+inline
+int format_version(const char *magic) {
+  const char expected[] = {'h', 'u', 'f', 'f', 'e', 'r', '?', '\0'};
+  if (!std::equal(magic, magic + 6, expected) || magic[7] != '\0' ||
+      magic[6] < '1' || magic[6] > '4') {
+    return 0;
+  }
+  return magic[6] - '0';
+}
+
+// Build into the specified `decode_table` the code words of a file in the
+// specified `version` of the format, reading them from the specified `in`
+// unless the version is 4, in which case they are those of the specified
+// `table`. The specified `symbol_size` is that of the file. Return zero on
+// success or a nonzero value if an error occurs. The behavior is undefined if
+// `version` is 4 and `table` is null.
+inline
+int read_code(InputBitStream& in, int version, std::size_t symbol_size, const CodeTable *table, DecodeTable& decode_table) {
+  if (version == 4) {
+    decode_table.assign(table->lengths, true);
+  } else if (version == 1) {
+    const Tree tree = read_tree(in, symbol_size);
+    if (tree.empty()) {
+      return 8;
+    }
+    decode_table.assign(tree);
+  } else {
+    const std::vector<CodeLength> lengths = read_code_lengths(in, symbol_size);
+    if (lengths.empty()) {
+      return 8;
+    }
+    decode_table.assign(lengths);
+  }
+  return 0;
+}
+
+// Decode the specified `count` symbols of the specified `SymbolSize` from
+// each of the specified `streams`, one `lane` for each stream, using the
+// specified `table`, and store them starting at the corresponding element of
+// the specified `outputs`. Advance `streams` and `outputs` past what was
+// decoded. Return whether the streams contained valid code words.
+// The lanes take turns decoding one symbol each, and are unrolled so that
+// each lane's cursor can live in registers.
+template <std::size_t... lane, std::size_t size>
+bool decode_lanes(std::index_sequence<lane...>, BitCursor *streams, const DecodeTable& table, SymbolSize<size>, std::uint64_t count, char **outputs) {
+  const DecodeTable::Entry *const entries = table.data();
+  const int primary_bits = table.primary_bits();
+  BitCursor cursors[] = {streams[lane]...};
+  char *next[] = {outputs[lane]...};
+  for (std::uint64_t j = 0; j < count; ++j) {
+    if (!(decode_symbol(cursors[lane], entries, primary_bits, next[lane]) & ...)) {
+      return false;
+    }
+    ((next[lane] += size), ...);
+  }
+  ((streams[lane] = cursors[lane]), ...);
+  ((outputs[lane] = next[lane]), ...);
+  return true;
+}
+
+// Decode from each of the specified `streams` the symbols of one of a block's
+// consecutive parts (see `BlockKind::huffman_streams`) using the specified
+// `table`, and store them contiguously starting at the specified `output`,
+// which must have room for the block's symbols, each of the specified
+// `symbol_size`, plus `sizeof(Symbol)` bytes.
+// Each stream but the last has the specified `per_stream` symbols, and the
+// last has the specified `last_count` symbols, which is at least
+// `per_stream`. Return whether the streams contained valid code words.
+// Up to four streams are decoded at a time, taking turns, so that the
+// processor can overlap the work of the independent streams rather than
+// waiting on one stream's serial chain of table lookups.
+HUFFER_KERNEL
+inline
+bool decode_streams(std::vector<BitCursor>& streams, const DecodeTable& table, std::size_t symbol_size, std::uint64_t per_stream, std::uint64_t last_count, char *output) {
+  const std::size_t count = streams.size();
+  char *outputs[max_streams];
+  for (std::size_t i = 0; i < count; ++i) {
+    outputs[i] = output + i * per_stream * symbol_size;
+  }
+
+  // Storing whole `Symbol`s at the end of a part would overwrite the
+  // beginning of the next part, which is already decoded. So, the last few
+  // symbols of each part but the last are stored exactly.
+  const std::uint64_t exact = std::min<std::uint64_t>(per_stream, (sizeof(Symbol) - 1) / symbol_size);
+  const std::uint64_t interleaved = per_stream - exact;
+  return with_symbol_size(symbol_size, [&](auto width) {
+    // Decode the streams four at a time.
+    for (std::size_t i = 0; i < count; i += 4) {
+      bool ok;
+      switch (std::min<std::size_t>(4, count - i)) {
+      case 1: ok = decode_lanes(std::make_index_sequence<1>{}, &streams[i], table, width, interleaved, &outputs[i]); break;
+      case 2: ok = decode_lanes(std::make_index_sequence<2>{}, &streams[i], table, width, interleaved, &outputs[i]); break;
+      case 3: ok = decode_lanes(std::make_index_sequence<3>{}, &streams[i], table, width, interleaved, &outputs[i]); break;
+      default: ok = decode_lanes(std::make_index_sequence<4>{}, &streams[i], table, width, interleaved, &outputs[i]);
+      }
+      if (!ok) {
+        return false;
+      }
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+      const std::uint64_t remaining = (i + 1 == count ? last_count : per_stream) - interleaved;
+      for (std::uint64_t j = 0; j < remaining; ++j) {
+        char symbol[sizeof(Symbol)];
+        if (!decode_symbol(streams[i], table.data(), table.primary_bits(), symbol)) {
+          return false;
+        }
+        std::memcpy(outputs[i], symbol, width);
+        outputs[i] += width;
+      }
+    }
+    return true;
+  });
+}
+
+// Decode the specified `encoded` part of a block of kind
+// `BlockKind::huffman_streams` whose decoded size is the specified
+// `decoded_size` and whose symbols are of the specified `symbol_size`, and
+// assign the result to the specified `decoded`, building the code words into
+// the specified `table`. Return zero on success or a nonzero value if an
+// error occurs. If the specified `reuse`, then the block is instead of kind
+// `BlockKind::huffman_streams_reuse`, and is decoded using `table` as is.
+inline
+int decode_streams_block(std::string_view encoded, std::uint64_t decoded_size, std::size_t symbol_size, DecodeTable& table, std::string& decoded, bool reuse) {
+  ArrayBuf buffer{encoded.data(), encoded.size()};
+  std::istream in{&buffer};
+  char raw_count;
+  if (!in.get(raw_count)) {
+    return 9;
+  }
+  const std::size_t count = std::uint8_t(raw_count);
+  const std::uint64_t symbol_count = decoded_size / symbol_size;
+  const std::uint64_t extra = decoded_size % symbol_size;
+  if (count < 2 || count > max_streams || symbol_count < count) {
+    return 10;
+  }
+  std::uint64_t sizes[max_streams];
+  std::uint64_t total = 1 + 8 * count + extra;
+  for (std::size_t i = 0; i < count; ++i) {
+    if (!read_u64(in, sizes[i])) {
+      return 9;
+    }
+    if (sizes[i] > encoded.size() || (total += sizes[i]) > encoded.size()) {
+      return 10;
+    }
+  }
+
+  const char *next = encoded.data() + 1 + 8 * count;
+  const std::size_t lengths_size = encoded.size() - total;
+  if (reuse) {
+    if (lengths_size != 0) {
+      return 10;
+    }
+  } else {
+    InputBitStream lengths_in{next, lengths_size};
+    const std::vector<CodeLength> lengths = read_code_lengths(lengths_in, symbol_size);
+    if (lengths.empty()) {
+      return 8;
+    }
+    table.assign(lengths);
+  }
+  next += lengths_size;
+  std::vector<BitCursor> streams;
+  streams.reserve(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    streams.emplace_back(next, sizes[i]);
+    next += sizes[i];
+  }
+
+  decoded.resize(decoded_size + sizeof(Symbol));
+  const std::uint64_t per_stream = symbol_count / count;
+  if (!decode_streams(streams, table, symbol_size, per_stream, symbol_count - (count - 1) * per_stream, decoded.data())) {
+    return 7;
+  }
+  decoded.resize(decoded_size);
+  std::memcpy(decoded.data() + symbol_count * symbol_size, next, extra);
+  return 0;
+}
+
+// Return whether the specified `kind` is that of a block that has data, rather
+// than `BlockKind::end` or an unknown kind.
+inline
+bool is_data_block(char kind) {
+  return kind == char(BlockKind::huffman) || kind == char(BlockKind::huffman_streams) ||
+         kind == char(BlockKind::stored) || kind == char(BlockKind::huffman_reuse) ||
+         kind == char(BlockKind::huffman_streams_reuse) || kind == char(BlockKind::huffman_context);
+}
+
+// Return whether the specified `kind` is that of a block that reuses the code
+// of a block before it.
+inline
+bool is_reuse_block(BlockKind kind) {
+  return kind == BlockKind::huffman_reuse || kind == BlockKind::huffman_streams_reuse;
+}
+
+// Decode the specified `encoded` part of a block of the specified `kind`,
+// which satisfies `is_data_block`, whose decoded size is the specified
+// `decoded_size` and whose symbols are of the specified `symbol_size`, and
+// assign the result to the specified `decoded`, building the code words into
+// the specified `table`. If `is_reuse_block(kind)`, then `table` is instead
+// the code of the block whose code is reused, and is left unchanged, and if
+// `kind` is `BlockKind::huffman_context`, then `table` is not used. Return
+// zero on success or a nonzero value if an error occurs.
+inline
+int decode_block(BlockKind kind, std::string_view encoded, std::uint64_t decoded_size, std::size_t symbol_size, DecodeTable& table, std::string& decoded) {
+  if (kind == BlockKind::stored) {
+    if (encoded.size() != decoded_size) {
+      return 10;
+    }
+    decoded.assign(encoded);
+    return 0;
+  }
+  if (kind == BlockKind::huffman_streams || kind == BlockKind::huffman_streams_reuse) {
+    return decode_streams_block(encoded, decoded_size, symbol_size, table, decoded, kind == BlockKind::huffman_streams_reuse);
+  }
+
+  InputBitStream bitin{encoded.data(), encoded.size()};
+  const std::uint64_t symbol_count = decoded_size / symbol_size;
+  decoded.resize(decoded_size + sizeof(Symbol));
+  if (kind == BlockKind::huffman_reuse) {
+    if (!decode_symbols(bitin, table, symbol_size, symbol_count, decoded.data())) {
+      return 7;
+    }
+  } else if (kind == BlockKind::huffman_context && symbol_count != 0) {
+    const std::vector<std::vector<CodeLength>> lengths = read_context_code_lengths(bitin, symbol_size);
+    if (lengths.empty()) {
+      return 8;
+    }
+    std::vector<DecodeTable> tables(context_count);
+    for (std::size_t context = 0; context < context_count; ++context) {
+      if (!lengths[context].empty()) {
+        tables[context].assign(lengths[context]);
+      }
+    }
+    if (!decode_context_symbols(bitin, tables, symbol_size, symbol_count, decoded.data())) {
+      return 7;
+    }
+  } else if (symbol_count != 0) {
+    const std::vector<CodeLength> lengths = read_code_lengths(bitin, symbol_size);
+    if (lengths.empty()) {
+      return 8;
+    }
+    table.assign(lengths);
+    if (!decode_symbols(bitin, table, symbol_size, symbol_count, decoded.data())) {
+      return 7;
+    }
+  }
+  decoded.resize(decoded_size);
+
+  for (std::uint64_t i = symbol_count * symbol_size; i < decoded_size; ++i) {
+    if (!(bitin >> decoded[i])) {
+      return 7;
+    }
+  }
+  return 0;
+}
+
+// Return the <index> (see `BlockKind`) at the end of the specified `size`
+// bytes at the specified `data`, which are a file in version 3 of the format,
+// or return an empty vector if the file has no valid index.
+inline
+std::vector<IndexEntry> read_index(const char *data, std::size_t size) {
+  const std::uint64_t trailer_size = 8 + sizeof index_magic;
+  if (size < file_header_size + 1 + trailer_size ||
+      !std::equal(index_magic, index_magic + sizeof index_magic, data + size - sizeof index_magic)) {
+    return {};
+  }
+  ArrayBuf buffer{data, size};
+  std::istream in{&buffer};
+  std::uint64_t count = 0;
+  if (!read_u64(in.seekg(size - trailer_size), count) ||
+      count > (size - file_header_size - 1 - trailer_size) / 16) {
+    return {};
+  }
+
+  // The blocks must be in order, and each must lie before the index.
+  const std::uint64_t index_offset = size - trailer_size - count * 16;
+  std::vector<IndexEntry> index(count);
+  in.seekg(index_offset);
+  for (std::uint64_t i = 0; i < count; ++i) {
+    IndexEntry& entry = index[i];
+    if (!read_u64(in, entry.offset) || !read_u64(in, entry.decoded_offset) ||
+        entry.offset < file_header_size || entry.offset >= index_offset ||
+        (i != 0 && (entry.offset <= index[i - 1].offset ||
+                    entry.decoded_offset <= index[i - 1].decoded_offset))) {
+      return {};
+    }
+  }
+  return index;
+}
+
+// `EncodeOptions` are the parameters of encoding.
+struct EncodeOptions {
+  // `symbol_size` is the size, in bytes, of each input symbol.
+  std::size_t symbol_size = 1;
+  // `max_code_length` is the length, in bits, of the longest code word that
+  // the encoder may produce.
+  int max_code_length = 32;
+  // `threads` is the number of threads that may count symbols.
+  unsigned threads = 1;
+};
+
+// `Encoder` compresses buffers in memory into memory provided by the caller.
+// Each input is encoded as a file in version 2 of the format, or in version
+// 4 if the encoder has a `CodeTable`. An encoder can be used for any number
+// of inputs, and it keeps its symbol table and code book between them, so
+// that encoding many small inputs doesn't allocate them anew each time.
+// Separate encoders can be used concurrently.
+class Encoder {
+  EncodeOptions options;
+  std::optional<CodeTable> table;
+  Symbols symbols;
+  std::vector<CodeLength> lengths;
+  CodeBook code_book;
+  // `escape` is the escape code word, if there is a `table`.
+  CodeWord escape;
+  OutputArrayBuf sink;
+  OutputBitStream out;
+
+public:
+  // Create an encoder that builds a code for each input as described by the
+  // optionally specified `options`.
+  explicit Encoder(const EncodeOptions& options = {});
+
+  // Create an encoder that encodes every input using the code words of the
+  // specified `table`.
+  explicit Encoder(const CodeTable& table);
+
+  Encoder(const Encoder&) = delete;
+  Encoder& operator=(const Encoder&) = delete;
+
+  // Return the largest possible encoded size of an input whose size is the
+  // specified `size`.
+  std::size_t max_encoded_size(std::size_t size) const;
+
+  // Encode the specified `input` into the beginning of the specified `output`,
+  // and assign the encoded size to the specified `written`. Return zero on
+  // success or a nonzero value if an error occurs. The error is 2 if the
+  // input has too many distinct symbols for the maximum code length, or 3 if
+  // `output` is too small, which it never is if its size is at least
+  // `max_encoded_size(input.size())`.
+  int encode(std::span<const std::byte> input, std::span<std::byte> output, std::size_t& written);
+};
+
+inline
+Encoder::Encoder(const EncodeOptions& options)
+: options(options)
+, symbols(options.symbol_size)
+, escape{}
+, out(sink) {
+}
+
+inline
+Encoder::Encoder(const CodeTable& table)
+: table(table)
+, symbols(table.symbol_size)
+, escape{}
+, out(sink) {
+  options.symbol_size = table.symbol_size;
+  assign_table(table, symbols, code_book, escape);
+}
+
+inline
+std::size_t Encoder::max_encoded_size(std::size_t size) const {
+  // The header is the magic, the total size, the symbol size, and, with a
+  // table, the fingerprint. Each symbol not in a table costs the escape code
+  // word in addition to the symbol itself.
+  const std::size_t header_size = 8 + 8 + 1 + 4;
+  if (table) {
+    return header_size + size + (size / options.symbol_size * escape.length + 7) / 8;
+  }
+  return header_size + huffer::max_encoded_size(size);
+}
+
+inline
+int Encoder::encode(std::span<const std::byte> input, std::span<std::byte> output, std::size_t& written) {
+  const char *data = reinterpret_cast<const char*>(input.data());
+  sink.reset(reinterpret_cast<char*>(output.data()), output.size());
+  out.bad(false);
+  if (table) {
+    write_version4(out, data, input.size(), *table, code_book, escape);
+  } else {
+    read_symbols(data, input.size(), options.threads, symbols);
+    if (!can_encode(symbols, options.max_code_length)) {
+      return 2;
+    }
+    lengths = build_code_lengths(symbols, options.max_code_length);
+    sort_canonical(lengths);
+    code_book.assign(symbols, lengths);
+    write_version2(out, data, symbols, lengths, code_book);
+  }
+  if (!out.flush_byte()) {
+    return 3;
+  }
+  written = sink.size();
+  return 0;
+}
+
+// `Decoder` decompresses buffers in memory, in any version of the format,
+// into memory provided by the caller. A decoder can be used for any number
+// of inputs, and it keeps its decoding table between them. Separate decoders
+// can be used concurrently.
+class Decoder {
+  // `table` and `table_code` are the code table (see `CodeTable`) with which
+  // inputs in version 4 of the format are decoded, if there is one, and its
+  // decoding table.
+  std::optional<CodeTable> table;
+  DecodeTable table_code;
+  // `code` is the decoding table of the most recent input (or block) that
+  // has code words of its own.
+  DecodeTable code;
+  // `block` is the most recently decoded block of an input in version 3 of
+  // the format.
+  std::string block;
+
+  // Decode into the specified `output` the specified `input`, which is in
+  // version 3 of the format, and assign the decoded size to the specified
+  // `written`. Return zero on success or a nonzero value if an error occurs.
+  int decode_blocks(std::span<const std::byte> input, std::span<std::byte> output, std::size_t& written);
+
+public:
+  // Create a decoder for inputs that don't use a code table.
+  Decoder() = default;
+
+  // Create a decoder that decodes inputs in version 4 of the format using the
+  // specified `table`.
+  explicit Decoder(const CodeTable& table);
+
+  // Assign to the specified `size` the decoded size of the specified `input`.
+  // Return zero on success or a nonzero value if an error occurs.
+  static int decoded_size(std::span<const std::byte> input, std::uint64_t& size);
+
+  // Decode the specified `input` into the beginning of the specified
+  // `output`, and assign the decoded size to the specified `written`. Return
+  // zero on success or a nonzero value if an error occurs. The errors are
+  // those of the command line's `decode`, where 11 means that `output` is
+  // too small, which it never is if its size is at least the input's
+  // `decoded_size`, and 13 means that the input was encoded with a code
+  // table other than this decoder's.
+  int decode(std::span<const std::byte> input, std::span<std::byte> output, std::size_t& written);
+};
+
+inline
+Decoder::Decoder(const CodeTable& table)
+: table(table)
+, table_code(table.lengths, true) {
+}
+
+inline
+int Decoder::decoded_size(std::span<const std::byte> input, std::uint64_t& size) {
+  const char *data = reinterpret_cast<const char*>(input.data());
+  if (input.size() < 8) {
+    return 2;
+  }
+  const int version = format_version(data);
+  if (version == 0) {
+    return 3;
+  }
+  if (version != 3) {
+    InputBitStream bitin{data + 8, input.size() - 8};
+    std::bitset<64> raw_total_size;
+    if (!(bitin >> raw_total_size)) {
+      return 4;
+    }
+    size = raw_total_size.to_ullong();
+    return 0;
+  }
+
+  // Add up the decoded sizes of the blocks (see `BlockKind`).
+  ArrayBuf buffer{data, input.size()};
+  std::istream in{&buffer};
+  in.seekg(file_header_size);
+  std::uint64_t total = 0;
+  for (;;) {
+    char kind;
+    std::uint64_t decoded_size = 0;
+    std::uint64_t encoded_size = 0;
+    if (!in.get(kind)) {
+      return 9;
+    }
+    if (kind == char(BlockKind::end)) {
+      break;
+    }
+    if (!read_u64(in, decoded_size) || !read_u64(in, encoded_size) ||
+        !in.seekg(encoded_size, std::ios_base::cur)) {
+      return 9;
+    }
+    total += decoded_size;
+  }
+  size = total;
+  return 0;
+}
+
+inline
+int Decoder::decode(std::span<const std::byte> input, std::span<std::byte> output, std::size_t& written) {
+  const char *data = reinterpret_cast<const char*>(input.data());
+  char *const decoded = reinterpret_cast<char*>(output.data());
+  if (input.size() < 8) {
+    return 2;
+  }
+  const int version = format_version(data);
+  if (version == 0) {
+    return 3;
+  }
+  if (version == 3) {
+    return decode_blocks(input, output, written);
+  }
+
+  InputBitStream bitin{data + 8, input.size() - 8};
+  std::bitset<64> raw_total_size;
+  bitin >> raw_total_size;
+  if (!bitin) {
+    return 4;
+  }
+  std::bitset<3> raw_symbol_size;
+  bitin >> raw_symbol_size;
+  if (!bitin) {
+    return 5;
+  }
+  const std::uint64_t total_size = raw_total_size.to_ullong();
+  const std::size_t symbol_size = raw_symbol_size.to_ulong() + 1;
+  if (version == 4) {
+    std::bitset<32> fingerprint;
+    if (!(bitin >> fingerprint)) {
+      return 4;
+    }
+    if (!table || table->fingerprint != fingerprint.to_ulong() || table->symbol_size != symbol_size) {
+      return 13;
+    }
+  }
+  if (total_size > output.size()) {
+    return 11;
+  }
+
+  // Symbols are stored whole (see `decode_symbols`) while there is room for
+  // them in `output`, and then one at a time.
+  const std::uint64_t expanded_size = total_size - (total_size % symbol_size);
+  if (expanded_size != 0) {
+    const DecodeTable *current = version == 4 ? &table_code : &code;
+    if (version != 4) {
+      if (int rc = read_code(bitin, version, symbol_size, nullptr, code)) {
+        return rc;
+      }
+    }
+    const std::uint64_t count = expanded_size / symbol_size;
+    const std::uint64_t whole = output.size() < sizeof(Symbol) ? 0 :
+      std::min<std::uint64_t>(count, (output.size() - sizeof(Symbol)) / symbol_size);
+    if (!decode_symbols(bitin, *current, symbol_size, whole, decoded)) {
+      return 7;
+    }
+    for (std::uint64_t i = whole; i < count; ++i) {
+      char symbol[sizeof(Symbol)];
+      if (!decode_symbols(bitin, *current, symbol_size, 1, symbol)) {
+        return 7;
+      }
+      std::memcpy(decoded + i * symbol_size, symbol, symbol_size);
+    }
+  }
+
+  // Copy over the remaining "extra" verbatim.
+  for (std::uint64_t i = expanded_size; i < total_size; ++i) {
+    if (!(bitin >> decoded[i])) {
+      return 7;
+    }
+  }
+  written = total_size;
+  return 0;
+}
+
+inline
+int Decoder::decode_blocks(std::span<const std::byte> input, std::span<std::byte> output, std::size_t& written) {
+  const char *data = reinterpret_cast<const char*>(input.data());
+  ArrayBuf buffer{data, input.size()};
+  std::istream in{&buffer};
+  in.seekg(8);
+  char raw_symbol_size;
+  if (!in.get(raw_symbol_size)) {
+    return 5;
+  }
+  const std::size_t symbol_size = std::uint8_t(raw_symbol_size) + 1;
+  if (symbol_size > max_symbol_size) {
+    return 6;
+  }
+
+  std::size_t position = 0;
+  // `coded` indicates that `code` holds the code of a block in this input,
+  // which later blocks can reuse.
+  bool coded = false;
+  for (;;) {
+    char kind;
+    if (!in.get(kind)) {
+      return 9;
+    }
+    if (kind == char(BlockKind::end)) {
+      break;
+    }
+    if (!is_data_block(kind)) {
+      return 10;
+    }
+    std::uint64_t decoded_size = 0;
+    std::uint64_t encoded_size = 0;
+    if (!read_u64(in, decoded_size) || !read_u64(in, encoded_size)) {
+      return 9;
+    }
+    if (decoded_size > max_block_size || encoded_size > max_encoded_size(decoded_size) ||
+        (kind == char(BlockKind::stored) && encoded_size != decoded_size)) {
+      return 10;
+    }
+    const std::uint64_t offset = in.tellg();
+    if (encoded_size > input.size() - offset) {
+      return 9;
+    }
+    if (decoded_size > output.size() - position) {
+      return 11;
+    }
+    const std::string_view encoded{data + offset, encoded_size};
+    if (kind == char(BlockKind::stored)) {
+      // Copy the block directly to the output.
+      std::memcpy(output.data() + position, encoded.data(), decoded_size);
+    } else {
+      if (is_reuse_block(BlockKind(kind)) && !coded) {
+        return 8;
+      }
+      if (int rc = decode_block(BlockKind(kind), encoded, decoded_size, symbol_size, code, block)) {
+        return rc;
+      }
+      coded = coded || kind == char(BlockKind::huffman) || kind == char(BlockKind::huffman_streams);
+      std::memcpy(output.data() + position, block.data(), decoded_size);
+    }
+    position += decoded_size;
+    in.seekg(encoded_size, std::ios_base::cur);
+  }
+  written = position;
+  return 0;
+}
+
+}  // namespace huffer
@@ -0,0 +1,504 @@
+#include "huffer.h"
+
+#include <algorithm>
+#include <bitset>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <istream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// `huffer_bench` measures a `huffer` executable against a corpus of generated
+// inputs, for every symbol size. Each input is encoded and then decoded by
+// separate runs of the executable, and the decoded output is compared with
+// the input. For each input and symbol size, it prints the compression
+// ratio, the size of the encoded file's header, and, for each of encoding
+// and decoding, the throughput, the peak resident set size, and the number
+// of processor cycles per symbol.
+
+// `Input` is a member of the corpus.
+struct Input {
+  const char *name;
+  std::string data;
+};
+
+// Return the specified `size` bytes of English-like text: words of a fixed
+// vocabulary, the more common ones chosen more often, in lines of varying
+// length.
+std::string generate_text(std::size_t size, std::mt19937_64& random) {
+  static const char *const words[] = {
+    "the", "of", "and", "to", "a", "in", "is", "that", "it", "was", "for",
+    "on", "are", "as", "with", "his", "they", "at", "be", "this", "from",
+    "have", "or", "by", "one", "had", "not", "but", "what", "all", "were",
+    "when", "we", "there", "can", "an", "your", "which", "their", "said",
+    "if", "do", "will", "each", "about", "how", "up", "out", "them", "then",
+    "she", "many", "some", "so", "these", "would", "other", "into", "has",
+    "more", "her", "two", "like", "him", "see", "time", "could", "no",
+    "make", "than", "first", "been", "its", "who", "now", "people", "my",
+    "made", "over", "did", "down", "only", "way", "find", "use", "may",
+    "water", "long", "little", "very", "after", "words", "called", "just",
+    "where", "most", "know", "compression", "Huffman", "symbol", "tree"};
+  constexpr std::size_t count = sizeof words / sizeof words[0];
+  std::string text;
+  std::size_t line = 0;
+  while (text.size() < size) {
+    // The product of two uniform indices favors the small ones.
+    const std::size_t word = random() % count * (random() % count) / count;
+    text += words[word];
+    line += std::char_traits<char>::length(words[word]);
+    if (line > 60 + random() % 20) {
+      text += ".\n";
+      line = 0;
+    } else {
+      text += ' ';
+    }
+  }
+  text.resize(size);
+  return text;
+}
+
+// Return the specified `size` bytes of binary records, each a little endian
+// sequence number, a small integer, and a float, such as a program might
+// write to a data file.
+std::string generate_binary(std::size_t size, std::mt19937_64& random) {
+  std::string data;
+  for (std::uint32_t sequence = 0; data.size() < size; ++sequence) {
+    const std::uint16_t kind = random() % 12;
+    const float value = float(random() % 100000) / 100;
+    char record[4 + 2 + 4];
+    std::memcpy(record, &sequence, 4);
+    std::memcpy(record + 4, &kind, 2);
+    std::memcpy(record + 6, &value, 4);
+    data.append(record, sizeof record);
+  }
+  data.resize(size);
+  return data;
+}
+
+// Return the specified `size` bytes of log lines, each having a timestamp, a
+// level, a component, and a message.
+std::string generate_logs(std::size_t size, std::mt19937_64& random) {
+  static const char *const levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+  static const char *const components[] = {"http", "db", "cache", "auth", "scheduler"};
+  static const char *const messages[] = {
+    "request completed", "connection opened", "connection closed",
+    "cache miss for key", "retrying operation", "slow query detected",
+    "user logged in", "token refreshed", "job scheduled", "timeout exceeded"};
+  std::string logs;
+  std::uint64_t milliseconds = 1700000000000;
+  char line[160];
+  while (logs.size() < size) {
+    milliseconds += random() % 250;
+    const int length = std::snprintf(line, sizeof line, "%llu [%s] %s: %s id=%u latency=%ums\n",
+      static_cast<unsigned long long>(milliseconds), levels[random() % 6], components[random() % 5],
+      messages[random() % 10], unsigned(random() % 100000), unsigned(random() % 2000));
+    logs.append(line, length);
+  }
+  logs.resize(size);
+  return logs;
+}
+
+// Return the specified `size` uniformly random bytes.
+std::string generate_random(std::size_t size, std::mt19937_64& random) {
+  std::string data(size, '\0');
+  for (char& byte : data) {
+    byte = char(random());
+  }
+  return data;
+}
+
+// Return the corpus, each of whose nonempty members is the specified `size`
+// bytes.
+std::vector<Input> generate_corpus(std::size_t size) {
+  std::mt19937_64 random;
+  std::vector<Input> corpus;
+  corpus.push_back({.name = "text", .data = generate_text(size, random)});
+  corpus.push_back({.name = "binary", .data = generate_binary(size, random)});
+  corpus.push_back({.name = "logs", .data = generate_logs(size, random)});
+  corpus.push_back({.name = "random", .data = generate_random(size, random)});
+  corpus.push_back({.name = "single", .data = std::string(size, 'a')});
+  corpus.push_back({.name = "empty", .data = {}});
+  return corpus;
+}
+
+// Return the size of the header of the specified `encoded` file, which is in
+// version 2 or 3 of the format: everything but its code words and its stored
+// bytes. In version 2, that is the magic, the total size, the symbol size,
+// and the code lengths. In version 3, it is the magic, the symbol size, and
+// for each block its kind, sizes, and code lengths (with, for streams, the
+// count and sizes of the streams), and the end.
+std::uint64_t header_size(const std::string& encoded) {
+  if (encoded.size() < 8 + 1) {
+    return encoded.size();
+  }
+  const int version = huffer::format_version(encoded.data());
+  if (version != 3) {
+    InputBitStream in{encoded.data() + 8, encoded.size() - 8};
+    std::bitset<64> raw_total_size;
+    std::bitset<3> raw_symbol_size;
+    in >> raw_total_size >> raw_symbol_size;
+    const std::size_t symbol_size = raw_symbol_size.to_ulong() + 1;
+    const std::vector<huffer::CodeLength> lengths = huffer::read_code_lengths(in, symbol_size);
+    return 8 + (64 + 3 + huffer::code_lengths_bits(lengths, symbol_size) + 7) / 8;
+  }
+
+  const std::size_t symbol_size = std::uint8_t(encoded[8]) + 1;
+  std::uint64_t size = huffer::file_header_size;
+  std::uint64_t offset = huffer::file_header_size;
+  while (offset < encoded.size() && encoded[offset] != char(huffer::BlockKind::end)) {
+    const auto kind = huffer::BlockKind(encoded[offset]);
+    huffer::ArrayBuf buffer{encoded.data() + offset + 1, encoded.size() - offset - 1};
+    std::istream in{&buffer};
+    std::uint64_t decoded_size = 0;
+    std::uint64_t encoded_size = 0;
+    if (!huffer::read_u64(in, decoded_size) || !huffer::read_u64(in, encoded_size) ||
+        encoded_size > encoded.size() - offset - huffer::block_header_size) {
+      break;
+    }
+    offset += huffer::block_header_size;
+    size += huffer::block_header_size;
+    const char *const block = encoded.data() + offset;
+    if (kind == huffer::BlockKind::huffman) {
+      InputBitStream bits{block, encoded_size};
+      size += (huffer::code_lengths_bits(huffer::read_code_lengths(bits, symbol_size), symbol_size) + 7) / 8;
+    } else if (kind == huffer::BlockKind::huffman_streams && encoded_size != 0) {
+      const std::uint64_t streams = 1 + 8 * std::uint64_t(std::uint8_t(block[0]));
+      if (streams <= encoded_size) {
+        InputBitStream bits{block + streams, encoded_size - streams};
+        size += streams + (huffer::code_lengths_bits(huffer::read_code_lengths(bits, symbol_size), symbol_size) + 7) / 8;
+      }
+    } else if (kind == huffer::BlockKind::huffman_context) {
+      InputBitStream bits{block, encoded_size};
+      size += (huffer::context_code_lengths_bits(huffer::read_context_code_lengths(bits, symbol_size), symbol_size) + 7) / 8;
+    }
+    offset += encoded_size;
+  }
+  return size + 1;
+}
+
+// Return the processor's time stamp counter, which counts cycles at the
+// processor's nominal frequency, or zero if there is none.
+std::uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// `Run` is the measurement of a run of a program.
+struct Run {
+  // `ok` is whether the program exited with status zero.
+  bool ok;
+  double seconds;
+  std::uint64_t cycles;
+  // `max_rss` is the peak resident set size, in kilobytes.
+  long max_rss;
+};
+
+// Run the program at the specified `path` with the specified `arguments`,
+// which end with a null pointer, reading standard input from the file at the
+// specified `input_path` and writing standard output to the file at the
+// specified `output_path`, and return its measurement.
+Run run(const char *path, char *const arguments[], const char *input_path, const char *output_path) {
+  const auto start = std::chrono::steady_clock::now();
+  const std::uint64_t start_cycles = read_cycles();
+  const pid_t child = ::fork();
+  if (child == 0) {
+    const int in = ::open(input_path, O_RDONLY);
+    const int out = ::open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in < 0 || out < 0 || ::dup2(in, STDIN_FILENO) < 0 || ::dup2(out, STDOUT_FILENO) < 0) {
+      ::_exit(127);
+    }
+    ::execv(path, arguments);
+    ::_exit(127);
+  }
+  int status = 0;
+  rusage usage = {};
+  const bool waited = child > 0 && ::wait4(child, &status, 0, &usage) == child;
+  const std::uint64_t cycles = read_cycles() - start_cycles;
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return Run{
+    .ok = waited && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+    .seconds = elapsed.count(),
+    .cycles = cycles,
+    .max_rss = usage.ru_maxrss};
+}
+
+// `Launcher` runs programs from a child process that is forked before the
+// corpus is generated. Linux counts the memory of the process that a program
+// is forked from in the program's peak resident set size, so programs are
+// run from a process that uses little memory.
+class Launcher {
+  pid_t child;
+  // `requests` is written to request a run, and `results` is read for its
+  // measurement.
+  int requests;
+  int results;
+
+  // Run the programs requested on the specified `requests`, writing their
+  // measurements to the specified `results`, until `requests` is closed.
+  [[noreturn]] static void serve(int requests, int results);
+
+public:
+  Launcher();
+  Launcher(const Launcher&) = delete;
+  Launcher& operator=(const Launcher&) = delete;
+  ~Launcher();
+
+  // Return whether the child process was created.
+  explicit operator bool() const { return child > 0; }
+
+  // Run the program as described for `run`, and return its measurement.
+  Run run(const char *path, const std::vector<const char*>& arguments, const char *input_path, const char *output_path);
+};
+
+Launcher::Launcher()
+: child(-1)
+, requests(-1)
+, results(-1) {
+  int request_pipe[2];
+  int result_pipe[2];
+  if (::pipe(request_pipe) != 0) {
+    return;
+  }
+  if (::pipe(result_pipe) != 0) {
+    ::close(request_pipe[0]);
+    ::close(request_pipe[1]);
+    return;
+  }
+  child = ::fork();
+  if (child == 0) {
+    ::close(request_pipe[1]);
+    ::close(result_pipe[0]);
+    serve(request_pipe[0], result_pipe[1]);
+  }
+  ::close(request_pipe[0]);
+  ::close(result_pipe[1]);
+  requests = request_pipe[1];
+  results = result_pipe[0];
+}
+
+Launcher::~Launcher() {
+  if (child > 0) {
+    ::close(requests);
+    ::close(results);
+    ::waitpid(child, nullptr, 0);
+  }
+}
+
+// A request is its size in bytes followed by null-terminated strings: the
+// input path, the output path, the program's path, and its arguments.
+void Launcher::serve(int requests, int results) {
+  std::vector<char> request;
+  std::vector<char*> strings;
+  std::uint32_t size;
+  while (::read(requests, &size, sizeof size) == sizeof size) {
+    request.resize(size);
+    std::size_t got = 0;
+    for (ssize_t rc; got < size && (rc = ::read(requests, request.data() + got, size - got)) > 0;) {
+      got += rc;
+    }
+    if (got != size || size == 0 || request.back() != '\0') {
+      break;
+    }
+    strings.clear();
+    for (char *string = request.data(); string != request.data() + size; string += std::strlen(string) + 1) {
+      strings.push_back(string);
+    }
+    if (strings.size() < 3) {
+      break;
+    }
+    strings.push_back(nullptr);
+    const Run result = ::run(strings[2], strings.data() + 2, strings[0], strings[1]);
+    if (::write(results, &result, sizeof result) != sizeof result) {
+      break;
+    }
+  }
+  ::_exit(0);
+}
+
+Run Launcher::run(const char *path, const std::vector<const char*>& arguments, const char *input_path, const char *output_path) {
+  std::string request(sizeof(std::uint32_t), '\0');
+  for (const char *string : {input_path, output_path, path}) {
+    request.append(string, std::strlen(string) + 1);
+  }
+  for (const char *argument : arguments) {
+    request.append(argument, std::strlen(argument) + 1);
+  }
+  const std::uint32_t size = request.size() - sizeof size;
+  std::memcpy(request.data(), &size, sizeof size);
+  Run result = {};
+  if (::write(requests, request.data(), request.size()) != ssize_t(request.size()) ||
+      ::read(results, &result, sizeof result) != sizeof result) {
+    result.ok = false;
+  }
+  return result;
+}
+
+// Run the program as described for `run` by the specified `launcher` the
+// specified `runs` times, and return the fastest run, or a failed run if any
+// failed.
+Run best_run(Launcher& launcher, int runs, const char *path, const std::vector<const char*>& arguments, const char *input_path, const char *output_path) {
+  Run best = launcher.run(path, arguments, input_path, output_path);
+  for (int i = 1; i < runs && best.ok; ++i) {
+    const Run next = launcher.run(path, arguments, input_path, output_path);
+    if (!next.ok || next.seconds < best.seconds) {
+      best = next;
+    }
+  }
+  return best;
+}
+
+// Return the contents of the file at the specified `path`.
+std::string read_file(const char *path) {
+  std::ifstream in{path, std::ios::binary};
+  return std::string(std::istreambuf_iterator<char>(in), {});
+}
+
+// Write the specified `data` to the file at the specified `path`. Return
+// whether successful.
+bool write_file(const char *path, const std::string& data) {
+  std::ofstream out{path, std::ios::binary};
+  return bool(out.write(data.data(), data.size()));
+}
+
+std::ostream& usage(std::ostream& out) {
+  return out <<
+    "huffer_bench - measure huffer against a generated corpus\n"
+    "\n"
+    "usage:\n"
+    "\n"
+    "  huffer_bench [--size=N] [--runs=N] HUFFER\n"
+    "    Encode and decode each member of a corpus (text,\n"
+    "    binary, logs, random, single symbol, and empty) of N\n"
+    "    bytes each, or 4194304 by default, with the HUFFER\n"
+    "    executable for every symbol size. Time the best of N\n"
+    "    runs, or 3 by default. Print a table of the results\n"
+    "    to standard output.\n";
+}
+
+// Assign to the specified `value` the number following the specified `prefix`
+// at the beginning of the specified `argument`. Return whether `argument`
+// begins with `prefix`, and set `valid` to `false` if the number is invalid.
+template <typename Number>
+bool parse_option(std::string_view argument, std::string_view prefix, Number& value, bool& valid) {
+  if (!argument.starts_with(prefix)) {
+    return false;
+  }
+  argument.remove_prefix(prefix.size());
+  const auto [end, error] = std::from_chars(argument.data(), argument.data() + argument.size(), value);
+  valid = error == std::errc() && end == argument.data() + argument.size() && value > 0;
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  std::size_t size = 4 << 20;
+  int runs = 3;
+  const char *huffer = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view argument = argv[i];
+    bool valid = true;
+    if (parse_option(argument, "--size=", size, valid) || parse_option(argument, "--runs=", runs, valid)) {
+      if (!valid) {
+        std::cerr << "Invalid option: " << argument << '\n' << usage;
+        return -1;
+      }
+    } else if (!huffer && !argument.starts_with("-")) {
+      huffer = argv[i];
+    } else {
+      std::cerr << "Unknown option: " << argument << '\n' << usage;
+      return -1;
+    }
+  }
+  if (!huffer) {
+    std::cerr << usage;
+    return -1;
+  }
+
+  // The launcher is created first, so that it doesn't share the corpus.
+  Launcher launcher;
+  if (!launcher) {
+    std::cerr << "Unable to create a launcher process.\n";
+    return 1;
+  }
+  char directory[] = "/tmp/huffer_bench.XXXXXX";
+  if (!::mkdtemp(directory)) {
+    std::cerr << "Unable to create a temporary directory.\n";
+    return 1;
+  }
+  const std::string input_path = std::string(directory) + "/input";
+  const std::string encoded_path = std::string(directory) + "/encoded";
+  const std::string decoded_path = std::string(directory) + "/decoded";
+
+  std::cout << std::left << std::setw(8) << "input" << std::right
+            << std::setw(6) << "size" << std::setw(8) << "ratio" << std::setw(9) << "header"
+            << std::setw(10) << "enc MB/s" << std::setw(10) << "dec MB/s"
+            << std::setw(10) << "enc RSS" << std::setw(10) << "dec RSS"
+            << std::setw(12) << "enc cyc/sym" << std::setw(12) << "dec cyc/sym" << '\n';
+  int rc = 0;
+  for (const Input& input : generate_corpus(size)) {
+    if (!write_file(input_path.c_str(), input.data)) {
+      std::cerr << "Unable to write " << input_path << ".\n";
+      rc = 1;
+      break;
+    }
+    for (std::size_t symbol_size = 1; symbol_size <= huffer::max_symbol_size; ++symbol_size) {
+      const std::string symbol_size_option = "--symbol-size=" + std::to_string(symbol_size);
+      const Run encode = best_run(launcher, runs, huffer, {"encode", symbol_size_option.c_str(), input_path.c_str()},
+                                  "/dev/null", encoded_path.c_str());
+      const std::string encoded = read_file(encoded_path.c_str());
+      const Run decode = best_run(launcher, runs, huffer, {"decode", encoded_path.c_str()},
+                                  "/dev/null", decoded_path.c_str());
+      std::cout << std::left << std::setw(8) << input.name << std::right << std::setw(6) << symbol_size;
+      if (!encode.ok || !decode.ok || read_file(decoded_path.c_str()) != input.data) {
+        std::cout << "  FAILED to " << (encode.ok ? "decode" : "encode") << '\n';
+        rc = 1;
+        continue;
+      }
+      // Rates are undefined for the empty input.
+      const std::uint64_t symbols = input.data.size() / symbol_size;
+      const auto rate = [&](double numerator, double denominator) -> std::ostream& {
+        if (input.data.empty()) {
+          return std::cout << '-';
+        }
+        return std::cout << numerator / denominator;
+      };
+      std::cout << std::fixed << std::setprecision(3) << std::setw(8);
+      rate(encoded.size(), input.data.size()) << std::setw(9) << header_size(encoded)
+                                               << std::setprecision(1) << std::setw(10);
+      rate(input.data.size() / 1e6, encode.seconds) << std::setw(10);
+      rate(input.data.size() / 1e6, decode.seconds)
+        << std::setw(8) << encode.max_rss / 1024.0 << "MB"
+        << std::setw(8) << decode.max_rss / 1024.0 << "MB" << std::setw(12);
+      rate(encode.cycles, symbols) << std::setw(12);
+      rate(decode.cycles, symbols) << '\n';
+    }
+  }
+
+  std::remove(input_path.c_str());
+  std::remove(encoded_path.c_str());
+  std::remove(decoded_path.c_str());
+  ::rmdir(directory);
+  return rc;
+}
@@ -0,0 +1,271 @@
+#include "huffer.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// `huffer_microbench` times the stages of encoding and decoding in isolation:
+// the bit stream primitives, and, for alphabets of 256 up to millions of
+// symbols, the construction of codes and the reading and writing of their
+// descriptions. The symbol frequencies follow one of several synthetic
+// distributions, so that it's apparent which stage scales worst as the
+// alphabet grows. The alphabets are of four byte symbols, so that the
+// largest alphabets are possible and all are kept in the same kind of table.
+
+using namespace huffer;
+
+// `Distribution` is a shape of symbol frequencies.
+enum class Distribution {
+  // Each symbol is equally frequent.
+  uniform,
+  // The frequency of the symbol of rank `i` is proportional to `1 / i`.
+  zipf,
+  // The frequency of each symbol is a fixed fraction of the one before it,
+  // such that the least frequent is about e^-16 times the most frequent.
+  geometric
+};
+
+// `benchmark_symbol_size` is the size of the symbols in the synthetic
+// alphabets.
+constexpr std::size_t benchmark_symbol_size = 4;
+
+// Return the specified `count` symbols, whose frequencies follow the specified
+// `distribution`.
+Symbols make_symbols(Distribution distribution, std::size_t count) {
+  Symbols symbols{benchmark_symbol_size};
+  const double ratio = 1 - 16.0 / count;
+  for (std::size_t i = 0; i < count; ++i) {
+    double frequency = 0;
+    switch (distribution) {
+      case Distribution::uniform:
+        frequency = 1000;
+        break;
+      case Distribution::zipf:
+        frequency = 1e9 / (i + 1);
+        break;
+      case Distribution::geometric:
+        frequency = 1e9 * std::pow(ratio, double(i));
+        break;
+    }
+    const std::uint64_t rounded = std::max<std::uint64_t>(1, std::llround(frequency));
+    symbols.info.add(std::uint64_t(i), rounded);
+    symbols.total_size += rounded * benchmark_symbol_size;
+  }
+  return symbols;
+}
+
+// Return the canonical code lengths of the specified `symbols`, as for
+// encoding.
+std::vector<CodeLength> make_lengths(const Symbols& symbols) {
+  std::vector<CodeLength> lengths = build_code_lengths(symbols, 32);
+  sort_canonical(lengths);
+  return lengths;
+}
+
+// `NullBuf` is a `std::streambuf` that discards its output.
+class NullBuf : public std::streambuf {
+protected:
+  int_type overflow(int_type ch) override {
+    return traits_type::not_eof(ch);
+  }
+  std::streamsize xsputn(const char *, std::streamsize count) override {
+    return count;
+  }
+};
+
+// Write to the specified `out` the specified `tree` of symbols of the
+// specified `symbol_size` in the format read by `read_tree`, which encoding no
+// longer writes. Deep trees are walked without recursion.
+void write_tree(OutputBitStream& out, const Tree& tree, std::size_t symbol_size) {
+  std::vector<const Node*> pending{&tree.root()};
+  while (!pending.empty()) {
+    const Node& node = *pending.back();
+    pending.pop_back();
+    if (node.type == Node::Type::leaf) {
+      out << true;
+      write_symbol(out, node.leaf, symbol_size);
+    } else {
+      out << false;
+      pending.push_back(&tree.right(node));
+      pending.push_back(&tree.left(node));
+    }
+  }
+}
+
+// `bit_count` is the number of bits put or gotten per iteration of the bit
+// stream benchmarks.
+constexpr std::size_t bit_count = 1 << 23;
+
+void BM_OutputBitStream_put(benchmark::State& state) {
+  std::mt19937_64 random;
+  std::vector<std::uint64_t> words(bit_count / 64);
+  for (std::uint64_t& word : words) {
+    word = random();
+  }
+  NullBuf sink;
+  for (auto _ : state) {
+    OutputBitStream out{sink};
+    for (const std::uint64_t word : words) {
+      for (int i = 0; i < 64; ++i) {
+        out.put((word >> i) & 1);
+      }
+    }
+    out.flush_byte();
+  }
+  state.SetItemsProcessed(state.iterations() * bit_count);
+}
+BENCHMARK(BM_OutputBitStream_put);
+
+void BM_InputBitStream_get(benchmark::State& state) {
+  std::mt19937_64 random;
+  std::string data(bit_count / 8, '\0');
+  for (char& byte : data) {
+    byte = char(random());
+  }
+  for (auto _ : state) {
+    InputBitStream in{data.data(), data.size()};
+    std::uint64_t ones = 0;
+    bool bit = false;
+    while (in.get(bit)) {
+      ones += bit;
+    }
+    benchmark::DoNotOptimize(ones);
+  }
+  state.SetItemsProcessed(state.iterations() * bit_count);
+}
+BENCHMARK(BM_InputBitStream_get);
+
+// Put the code words of the symbols of an alphabet of `state.range(0)`
+// symbols, in proportion to their frequencies, as encoding does.
+template <Distribution distribution>
+void BM_OutputBitStream_put_bits(benchmark::State& state) {
+  Symbols symbols = make_symbols(distribution, state.range(0));
+  const std::vector<CodeLength> lengths = make_lengths(symbols);
+  std::vector<CodeWord> code_words;
+  for_each_code_word(lengths, [&](std::size_t, CodeWord code_word) {
+    code_words.push_back(code_word);
+  });
+  // Choose the code words by the symbols' frequencies, which is how often
+  // they'd appear in the input.
+  std::vector<double> weights;
+  for (const CodeLength& entry : lengths) {
+    weights.push_back(double(symbols.info.find(entry.symbol)->frequency));
+  }
+  std::discrete_distribution<std::size_t> choose(weights.begin(), weights.end());
+  std::mt19937_64 random;
+  std::vector<CodeWord> message(1 << 20);
+  for (CodeWord& code_word : message) {
+    code_word = code_words[choose(random)];
+  }
+  NullBuf sink;
+  for (auto _ : state) {
+    OutputBitStream out{sink};
+    for (const CodeWord& code_word : message) {
+      out.put_bits(code_word.bits, code_word.length);
+    }
+    out.flush_byte();
+  }
+  state.SetItemsProcessed(state.iterations() * message.size());
+}
+
+template <Distribution distribution>
+void BM_build_tree(benchmark::State& state) {
+  const Symbols symbols = make_symbols(distribution, state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(build_tree(symbols));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <Distribution distribution>
+void BM_build_code_lengths(benchmark::State& state) {
+  const Symbols symbols = make_symbols(distribution, state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(make_lengths(symbols));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <Distribution distribution>
+void BM_build_code_words(benchmark::State& state) {
+  Symbols symbols = make_symbols(distribution, state.range(0));
+  const std::vector<CodeLength> lengths = make_lengths(symbols);
+  for (auto _ : state) {
+    build_code_words(symbols, lengths);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Code lengths replaced the tree in the current format, so writing them
+// stands in for writing the tree. The tree is still read, for version 1.
+template <Distribution distribution>
+void BM_write_code_lengths(benchmark::State& state) {
+  const Symbols symbols = make_symbols(distribution, state.range(0));
+  const std::vector<CodeLength> lengths = make_lengths(symbols);
+  NullBuf sink;
+  for (auto _ : state) {
+    OutputBitStream out{sink};
+    write_code_lengths(out, lengths, benchmark_symbol_size);
+    out.flush_byte();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <Distribution distribution>
+void BM_read_code_lengths(benchmark::State& state) {
+  const Symbols symbols = make_symbols(distribution, state.range(0));
+  std::stringstream encoded;
+  {
+    OutputBitStream out{*encoded.rdbuf()};
+    write_code_lengths(out, make_lengths(symbols), benchmark_symbol_size);
+    out.flush_byte();
+  }
+  const std::string data = encoded.str();
+  for (auto _ : state) {
+    InputBitStream in{data.data(), data.size()};
+    benchmark::DoNotOptimize(read_code_lengths(in, benchmark_symbol_size));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <Distribution distribution>
+void BM_read_tree(benchmark::State& state) {
+  const Symbols symbols = make_symbols(distribution, state.range(0));
+  std::stringstream encoded;
+  {
+    OutputBitStream out{*encoded.rdbuf()};
+    write_tree(out, build_tree(symbols), benchmark_symbol_size);
+    out.flush_byte();
+  }
+  const std::string data = encoded.str();
+  for (auto _ : state) {
+    InputBitStream in{data.data(), data.size()};
+    benchmark::DoNotOptimize(read_tree(in, benchmark_symbol_size));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Register the specified `BENCHMARK` for each distribution and for alphabets
+// of 256 up to about two million symbols.
+#define HUFFER_ALPHABET_BENCHMARK(BENCHMARK)                                             \
+  BENCHMARK_TEMPLATE(BENCHMARK, Distribution::uniform)->RangeMultiplier(8)->Range(256, 1 << 21);   \
+  BENCHMARK_TEMPLATE(BENCHMARK, Distribution::zipf)->RangeMultiplier(8)->Range(256, 1 << 21);      \
+  BENCHMARK_TEMPLATE(BENCHMARK, Distribution::geometric)->RangeMultiplier(8)->Range(256, 1 << 21)
+
+HUFFER_ALPHABET_BENCHMARK(BM_OutputBitStream_put_bits);
+HUFFER_ALPHABET_BENCHMARK(BM_build_tree);
+HUFFER_ALPHABET_BENCHMARK(BM_build_code_lengths);
+HUFFER_ALPHABET_BENCHMARK(BM_build_code_words);
+HUFFER_ALPHABET_BENCHMARK(BM_write_code_lengths);
+HUFFER_ALPHABET_BENCHMARK(BM_read_code_lengths);
+HUFFER_ALPHABET_BENCHMARK(BM_read_tree);
+
+BENCHMARK_MAIN();
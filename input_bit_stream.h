@@ -1,26 +1,62 @@
+#include <algorithm>
+#include <bit>
 #include <bitset>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <streambuf>
+#include <vector>
 
 class InputBitStream {
-  // `streambuf` is a source of bytes from which bits are read.
-  std::streambuf& streambuf;
-  // `current` is the "buffer" of the byte most recently read from `streambuf`.
-  std::byte current;
-  // `mask` is a bit mask that identifies the next bit in `current` to be
-  // returned by `get`. If `mask` is zero, then it is time to read another byte
-  // into `current` from `streambuf`.
-  std::byte mask;
+  // `streambuf` is a source of bytes from which bits are read, or null if the
+  // input is entirely in memory.
+  std::streambuf *streambuf;
+  // `block` contains bytes read from `streambuf` many at a time. The bytes
+  // from `next` up to `end` have not yet been moved into `buffer`. If the
+  // input is in memory, then `next` and `end` refer to it instead.
+  std::vector<char> block;
+  const char *next;
+  const char *end;
+  // `buffer` contains bits that have been read from `block` but not yet
+  // consumed. The next bit to be consumed is the least significant bit.
+  std::uint64_t buffer;
+  // `buffered` is the number of valid bits in `buffer`. The bits above those
+  // are either zero or the bits that follow in the input.
+  int buffered;
   // These are the status bits. See the corresponding accessor functions for
   // their meaning.
   bool eof_bit : 1;
   bool fail_bit : 1;
   bool bad_bit : 1;
+  // `drained` indicates that `streambuf` has been exhausted (or failed, if
+  // `broken` is also set) while reading ahead. Reading ahead is not itself an
+  // input operation, so the status bits are not set until an input operation
+  // actually runs out of bits.
+  bool drained : 1;
+  bool broken : 1;
+
+  // Move bytes from `block` into `buffer` until either `buffer` cannot hold
+  // another byte or there is no more input, reading more of `streambuf` into
+  // `block` as necessary.
+  void refill();
+
+  // Replace the contents of `block` with bytes read from `streambuf`. Return
+  // whether any bytes were read.
+  bool read_block();
+
+  // Set the status bits to indicate that an input operation ran out of bits.
+  void run_dry();
 
 public:
+  // `block_size` is the number of bytes requested from the source at a time.
+  static constexpr std::size_t block_size = 64 * 1024;
+
   explicit InputBitStream(std::streambuf& source);
 
+  // Read bits from the specified `size` bytes at the specified `data`, which
+  // must remain valid for the lifetime of this object.
+  InputBitStream(const char *data, std::size_t size);
+
   // If `eof()`, then the stream has exhausted the input bits.
   bool eof() const { return eof_bit; }
   // If `fail()`, then the previous input operation did not consume all of the
@@ -48,6 +84,29 @@ public:
   // If a bit could not be read due to an error, `bad()` will subsequently
   // return `true`.
   InputBitStream& get(bool& bit);
+
+  // `max_peek` is the largest number of bits that `peek` can look ahead.
+  static constexpr int max_peek = 57;
+
+  // Return the next `count` bits of input without consuming them, where the
+  // first bit is the least significant. If fewer than `count` bits remain in
+  // the input, then the missing high order bits are zero. The behavior is
+  // undefined unless `0 <= count && count <= max_peek`.
+  std::uint64_t peek(int count);
+
+  // Discard the next `count` bits of input. Return a reference to this object.
+  // If fewer than `count` bits remain in the input, then the remaining bits are
+  // discarded and the status bits are set as described for `get`. The
+  // behavior is undefined unless `0 <= count && count <= max_peek`.
+  InputBitStream& consume(int count);
+
+  // Assign to the specified `bits` the next `count` bits of input, where the
+  // first bit is the least significant, and consume them. Return a reference
+  // to this object. If fewer than `count` bits remain in the input, then the
+  // remaining bits are discarded, `bits` is not modified, and the status bits
+  // are set as described for `get`. The behavior is undefined unless
+  // `0 <= count && count <= max_peek`.
+  InputBitStream& read_bits(std::uint64_t& bits, int count);
 };
 
 InputBitStream& operator>>(InputBitStream&, bool&);
@@ -57,37 +116,141 @@ InputBitStream& operator>>(InputBitStream&, char&);
 
 inline
 InputBitStream::InputBitStream(std::streambuf& source)
-: streambuf(source)
-, current{0}
-, mask{0}
+: streambuf(&source)
+, block(block_size)
+, next(block.data())
+, end(block.data())
+, buffer(0)
+, buffered(0)
+, eof_bit(false)
+, fail_bit(false)
+, bad_bit(false)
+, drained(false)
+, broken(false) {
+}
+
+inline
+InputBitStream::InputBitStream(const char *data, std::size_t size)
+: streambuf(nullptr)
+, next(data)
+, end(data + size)
+, buffer(0)
+, buffered(0)
 , eof_bit(false)
 , fail_bit(false)
-, bad_bit(false) {
+, bad_bit(false)
+, drained(true)
+, broken(false) {
+}
+
+inline
+bool InputBitStream::read_block() {
+  if (drained) {
+    return false;
+  }
+  std::streamsize count;
+  try {
+    count = streambuf->sgetn(block.data(), block.size());
+  } catch (...) {
+    drained = true;
+    broken = true;
+    return false;
+  }
+  if (count <= 0) {
+    drained = true;
+    return false;
+  }
+  next = block.data();
+  end = next + count;
+  return true;
+}
+
+inline
+void InputBitStream::refill() {
+  if (end - next >= 8) {
+    // Fast path: Load eight bytes at once, and keep as many whole bytes as
+    // fit. The surplus bits are the ones that follow in the input, and so
+    // they need not be cleared.
+    std::uint64_t word = 0;
+    if constexpr (std::endian::native == std::endian::little) {
+      std::memcpy(&word, next, 8);
+    } else {
+      for (int i = 0; i < 8; ++i) {
+        word |= std::uint64_t(std::uint8_t(next[i])) << (8 * i);
+      }
+    }
+    buffer |= word << buffered;
+    next += (63 - buffered) / 8;
+    buffered |= 56;
+    return;
+  }
+
+  while (buffered <= 64 - 8) {
+    if (next == end && !read_block()) {
+      return;
+    }
+    buffer |= std::uint64_t(std::uint8_t(*next++)) << buffered;
+    buffered += 8;
+  }
+}
+
+inline
+void InputBitStream::run_dry() {
+  if (broken) {
+    bad(true);
+  } else {
+    eof(true);
+  }
+  fail(true);
 }
 
 inline
 InputBitStream& InputBitStream::get(bool& bit) {
-  // If we're out of bits in `current`, read another byte.
-  if (mask == std::byte{0}) {
-    int ch;
-    try {
-      ch = streambuf.sbumpc();
-    } catch (...) {
-      bad(true);
-      fail(true);
+  if (buffered == 0) {
+    refill();
+    if (buffered == 0) {
+      run_dry();
       return *this;
     }
-    if (ch == std::streambuf::traits_type::eof()) {
-      eof(true);
-      fail(true);
+  }
+
+  bit = buffer & 1;
+  buffer >>= 1;
+  --buffered;
+  return *this;
+}
+
+inline
+std::uint64_t InputBitStream::peek(int count) {
+  if (buffered < count) {
+    refill();
+  }
+  return buffer & ((std::uint64_t(1) << count) - 1);
+}
+
+inline
+InputBitStream& InputBitStream::consume(int count) {
+  if (buffered < count) {
+    refill();
+    if (buffered < count) {
+      buffer = 0;
+      buffered = 0;
+      run_dry();
       return *this;
     }
-    current = std::byte{std::uint8_t(ch & 0xff)};
-    mask = std::byte{1};
   }
 
-  bit = (current & mask) != std::byte{0};
-  mask <<= 1;
+  buffer >>= count;
+  buffered -= count;
+  return *this;
+}
+
+inline
+InputBitStream& InputBitStream::read_bits(std::uint64_t& bits, int count) {
+  const std::uint64_t value = peek(count);
+  if (consume(count)) {
+    bits = value;
+  }
   return *this;
 }
 
@@ -98,22 +261,25 @@ InputBitStream& operator>>(InputBitStream& stream, bool& bit) {
 
 template <std::size_t n>
 InputBitStream& operator>>(InputBitStream& stream, std::bitset<n>& bits) {
-  for (int i = 0; i < int(bits.size()); ++i) {
-    bool bit;
-    stream >> bit;
-    if (!stream) {
+  // Read up to 32 bits at a time.
+  for (std::size_t i = 0; i < n; i += 32) {
+    const int count = std::min<std::size_t>(32, n - i);
+    std::uint64_t chunk;
+    if (!stream.read_bits(chunk, count)) {
       break;
     }
-    bits[i] = bit;
+    for (int j = 0; j < count; ++j) {
+      bits[i + j] = (chunk >> j) & 1;
+    }
   }
   return stream;
 }
 
 inline
 InputBitStream& operator>>(InputBitStream& stream, char& byte) {
-  std::bitset<8> bits;
-  if (stream >> bits) {
-    byte = char(bits.to_ulong());
+  std::uint64_t bits;
+  if (stream.read_bits(bits, 8)) {
+    byte = char(bits);
   }
   return stream;
 }
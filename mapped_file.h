@@ -0,0 +1,128 @@
+#include <cerrno>
+#include <cstddef>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// `MappedFile` is the entire contents of a file, viewed in memory. Regular
+// files are mapped into memory, so that their contents are read directly from
+// the page cache. Other files (e.g. pipes), and files that cannot be mapped,
+// are instead read into a buffer many bytes at a time.
+class MappedFile {
+  const char *begin;
+  std::size_t length;
+  // `mapped` indicates that `begin` is the start of a mapping that must be
+  // unmapped. Otherwise, `begin` refers to `contents`.
+  bool mapped;
+  std::vector<char> contents;
+
+  // `read_size` is the number of bytes requested at a time when the file is
+  // not mapped.
+  static constexpr std::size_t read_size = 1 << 20;
+
+  // Read the rest of the specified `fd` into `contents`. Return whether
+  // successful.
+  bool read_all(int fd);
+
+  // Unmap or release the current contents, if any.
+  void close();
+
+public:
+  MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  // Load the file at the specified `path`, replacing any previous contents.
+  // Return whether successful.
+  bool open(const char *path);
+
+  // Load the file open as the specified `fd` (e.g. standard input), which
+  // remains open, replacing any previous contents. Return whether successful.
+  bool open(int fd);
+
+  const char *data() const { return begin; }
+  std::size_t size() const { return length; }
+};
+
+inline
+MappedFile::MappedFile()
+: begin(nullptr)
+, length(0)
+, mapped(false) {
+}
+
+inline
+MappedFile::~MappedFile() {
+  close();
+}
+
+inline
+void MappedFile::close() {
+  if (mapped) {
+    ::munmap(const_cast<char*>(begin), length);
+  }
+  begin = nullptr;
+  length = 0;
+  mapped = false;
+  contents.clear();
+}
+
+inline
+bool MappedFile::read_all(int fd) {
+  std::size_t count = 0;
+  for (;;) {
+    if (contents.size() - count < read_size) {
+      contents.resize(count + read_size);
+    }
+    const ssize_t rc = ::read(fd, contents.data() + count, contents.size() - count);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (rc == 0) {
+      break;
+    }
+    count += rc;
+  }
+  contents.resize(count);
+  begin = contents.data();
+  length = count;
+  return true;
+}
+
+inline
+bool MappedFile::open(const char *path) {
+  const int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    close();
+    return false;
+  }
+  const bool success = open(fd);
+  ::close(fd);
+  return success;
+}
+
+inline
+bool MappedFile::open(int fd) {
+  close();
+  struct stat status;
+  if (::fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0 &&
+      (begin = static_cast<const char*>(::mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0))) != MAP_FAILED) {
+    // The file is read from beginning to end, possibly twice.
+    ::madvise(const_cast<char*>(begin), status.st_size, MADV_SEQUENTIAL);
+    length = status.st_size;
+    mapped = true;
+    return true;
+  }
+
+  // It's not a regular file, it's empty (or claims to be, like some files in
+  // /proc), or it couldn't be mapped. Read it instead.
+  begin = nullptr;
+  return read_all(fd);
+}
@@ -1,25 +1,35 @@
+#include <bit>
 #include <bitset>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <streambuf>
 #include <vector>
 
 class OutputBitStream {
-  // `streambuf` is the "sink" to which bits will be written one byte at a
+  // `streambuf` is the "sink" to which bits will be written many bytes at a
   // time.
   std::streambuf& streambuf;
-  // `current` is the "buffer" of the byte that, once filled with bits, will be
-  // written to `streambuf`.
-  std::byte current;
-  // `mask` is a bit mask that indicates the next bit in `current` to be
-  // overwritten by `put`. If `mask` is zero, then it is time to write
-  // `current` to `streambuf (see `flush_byte`).
-  std::byte mask;
+  // `accumulator` is the "buffer" of bits that, once 64 of them have been
+  // put, will be appended to `buffer`. The first bit put is the least
+  // significant.
+  std::uint64_t accumulator;
+  // `accumulated` is the number of bits in `accumulator`. It is always less
+  // than 64.
+  int accumulated;
+  // `buffer` contains whole bytes that have not yet been written to
+  // `streambuf`. Its first `buffered` bytes are meaningful.
+  std::vector<char> buffer;
+  std::size_t buffered;
   // Output doesn't have a concept of "end of file," so the only failure
   // condition is the error or "bad" condition.
   bool bad_bit : 1;
 
 public:
+  // `buffer_size` is the number of bytes buffered before they are written to
+  // the sink.
+  static constexpr std::size_t buffer_size = 64 * 1024;
+
   explicit OutputBitStream(std::streambuf& sink);
 
   // Send any remaining bits to the sink, but don't flush the sink.
@@ -36,11 +46,28 @@ public:
   // to this object.
   OutputBitStream& put(bool bit);
 
+  // Buffer the low order `count` bits of the specified `bits` for writing to
+  // the output, least significant bit first. Return a reference to this
+  // object. The behavior is undefined unless `0 <= count && count <= 64` and
+  // the bits of `bits` above the low order `count` bits are zero.
+  // Errors writing to the sink are detected only when buffered bytes are
+  // written to it, after which `bad()` returns `true` and any further output
+  // is discarded.
+  OutputBitStream& put_bits(std::uint64_t bits, int count);
+
   // Write any buffered output bits to the sink (i.e. the destination
   // `std::streambuf`), but don't flush the sink. If there is less than a byte
   // buffered, then pad the extra high order bits with zeros before writing to
   // the sink.
   OutputBitStream& flush_byte();
+
+private:
+  // Append the specified `count` low order bytes of the specified `bits` to
+  // `buffer`, least significant byte first, making room if necessary.
+  void append(std::uint64_t bits, int count);
+
+  // Write the contents of `buffer` to the sink.
+  void drain();
 };
 
 OutputBitStream& operator<<(OutputBitStream&, bool);
@@ -52,8 +79,10 @@ OutputBitStream& operator<<(OutputBitStream&, const std::bitset<n>&);
 inline
 OutputBitStream::OutputBitStream(std::streambuf& sink)
 : streambuf(sink)
-, current{0}
-, mask{1}
+, accumulator(0)
+, accumulated(0)
+, buffer(buffer_size)
+, buffered(0)
 , bad_bit{false} {
 }
 
@@ -64,46 +93,62 @@ OutputBitStream::~OutputBitStream() {
 
 inline
 OutputBitStream& OutputBitStream::put(bool bit) {
-  if (bad()) {
-    return *this;
-  }
+  return put_bits(bit, 1);
+}
 
-  if (mask == std::byte{0}) {
-    if (!flush_byte()) {
-      return *this;
-    }
+inline
+OutputBitStream& OutputBitStream::put_bits(std::uint64_t bits, int count) {
+  accumulator |= bits << accumulated;
+  if (accumulated + count < 64) {
+    accumulated += count;
+    return *this;
   }
 
-  if (bit) {
-    current |= mask;
-  }
-  mask <<= 1;
+  // `accumulator` is full. Append it to `buffer` and keep whatever didn't
+  // fit.
+  append(accumulator, 8);
+  accumulator = accumulated ? bits >> (64 - accumulated) : 0;
+  accumulated = accumulated + count - 64;
   return *this;
 }
 
 inline
-OutputBitStream& OutputBitStream::flush_byte() {
-  if (bad()) {
-    return *this;
+void OutputBitStream::append(std::uint64_t bits, int count) {
+  if (buffered + 8 > buffer.size()) {
+    drain();
   }
-
-  if (mask == std::byte{1}) {
-    return *this;
+  if constexpr (std::endian::native == std::endian::little) {
+    std::memcpy(buffer.data() + buffered, &bits, 8);
+  } else {
+    for (int i = 0; i < 8; ++i) {
+      buffer[buffered + i] = char(std::uint8_t(bits >> (8 * i)));
+    }
   }
+  buffered += count;
+}
 
-  try {
-    const int result = streambuf.sputc(char(std::uint8_t(current)));
-    if (result == std::streambuf::traits_type::eof()) {
+inline
+void OutputBitStream::drain() {
+  if (!bad() && buffered != 0) {
+    try {
+      if (streambuf.sputn(buffer.data(), buffered) != std::streamsize(buffered)) {
+        bad(true);
+      }
+    } catch (...) {
       bad(true);
-      return *this;
     }
-  } catch (...) {
-    bad(true);
-    return *this;
   }
+  buffered = 0;
+}
 
-  current = std::byte{0};
-  mask = std::byte{1};
+inline
+OutputBitStream& OutputBitStream::flush_byte() {
+  if (accumulated != 0) {
+    append(accumulator, (accumulated + 7) / 8);
+    accumulator = 0;
+    accumulated = 0;
+  }
+  drain();
   return *this;
 }
 
@@ -114,25 +159,33 @@ OutputBitStream& operator<<(OutputBitStream& stream, bool bit) {
 
 inline
 OutputBitStream& operator<<(OutputBitStream& stream, char ch) {
-  const std::uint8_t byte = ch;
-  for (int i = 0; i < 8 && stream; ++i) {
-    stream << bool(byte & (1 << i));
-  }
-  return stream;
+  return stream.put_bits(std::uint8_t(ch), 8);
 }
 
 inline
 OutputBitStream& operator<<(OutputBitStream& stream, const std::vector<bool>& bits) {
-  for (int i = 0; i < int(bits.size()) && stream; ++i) {
-    stream << bits[i];
+  // Gather the bits into words, and put a word at a time.
+  std::uint64_t word = 0;
+  int count = 0;
+  for (const bool bit : bits) {
+    word |= std::uint64_t(bit) << count;
+    if (++count == 64) {
+      stream.put_bits(word, count);
+      word = 0;
+      count = 0;
+    }
   }
-  return stream;
+  return stream.put_bits(word, count);
 }
 
 template <std::size_t n>
 OutputBitStream& operator<<(OutputBitStream& stream, const std::bitset<n>& bits) {
-  for (int i = 0; i < int(bits.size()) && stream; ++i) {
-    stream << bits[i];
+  if constexpr (n <= 64) {
+    return stream.put_bits(bits.to_ullong(), n);
+  } else {
+    for (int i = 0; i < int(bits.size()); ++i) {
+      stream << bool(bits[i]);
+    }
+    return stream;
   }
-  return stream;
 }